@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# bench.sh - Rough timing harness for tsh
+#
+# usage: bench.sh startup [n]
+#        bench.sh script [lines]
+#        bench.sh loop
+#
+#   startup   Run `<shell> -c /bin/true` n times (default 2000) with
+#             /bin/sh, ./tsh and ./tsh-static and report the mean
+#             wall time per run.
+#
+#   script    Run a generated script of builtins, 100000 lines by
+#             default, with /bin/sh, with tsh -C (parsed line by line),
+#             and with tsh compiling it into an empty cache and then
+#             running it from the cache. Reports the time per run.
+#
+#   loop      Run five nested for loops of ten words each, 100000
+#             passes of a builtin body, with bash, dash and ./tsh -c,
+#             and report the time per run.
+#
+
+# now - current time in nanoseconds
+now() { date +%s%N; }
+
+# timeit <n> <cmd...> - print the mean time in microseconds per run
+timeit()
+{
+    local n=$1 i t0 t1
+    shift
+    t0=$(now)
+    for ((i = 0; i < n; i++)); do
+        "$@" > /dev/null
+    done
+    t1=$(now)
+    echo $(( (t1 - t0) / n / 1000 ))
+}
+
+startup()
+{
+    local n=${1:-2000} sh
+    printf "%-16s %10s\n" "shell" "us/run"
+    for sh in /bin/sh ./tsh ./tsh-static; do
+        if [ -x "$sh" ]; then
+            printf "%-16s %10s\n" "$sh" "$(timeit $n $sh -c /bin/true)"
+        fi
+    done
+}
+
+script()
+{
+    local n=${1:-100000} dir i
+    dir=$(mktemp -d)
+    for ((i = 0; i < n; i++)); do
+        echo "jobs; jobs && jobs || jobs # line $i, 'not a word'"
+    done > "$dir/script"
+    printf "%-16s %10s\n" "run" "ms"
+    printf "%-16s %10s\n" "/bin/sh" "$(( $(timeit 1 /bin/sh "$dir/script") / 1000 ))"
+    printf "%-16s %10s\n" "tsh -C" "$(( $(timeit 1 ./tsh -C "$dir/script") / 1000 ))"
+    printf "%-16s %10s\n" "tsh (compile)" \
+        "$(( $(TSHCACHE=$dir/cache timeit 1 ./tsh "$dir/script") / 1000 ))"
+    printf "%-16s %10s\n" "tsh (cached)" \
+        "$(( $(TSHCACHE=$dir/cache timeit 1 ./tsh "$dir/script") / 1000 ))"
+    rm -rf "$dir"
+}
+
+loop()
+{
+    local cmd sh w="0 1 2 3 4 5 6 7 8 9"
+    cmd="for a in $w; do for b in $w; do for c in $w; do"
+    cmd="$cmd for d in $w; do for e in $w; do x=\$e; done; done; done; done; done"
+    printf "%-16s %10s\n" "shell" "ms"
+    for sh in bash dash ./tsh; do
+        if command -v $sh > /dev/null; then
+            printf "%-16s %10s\n" "$sh" "$(( $(timeit 1 $sh -c "$cmd") / 1000 ))"
+        fi
+    done
+}
+
+case "$1" in
+startup)
+    shift
+    startup "$@"
+    ;;
+script)
+    shift
+    script "$@"
+    ;;
+loop)
+    loop
+    ;;
+*)
+    echo "usage: $0 startup [n] | script [lines] | loop" >&2
+    exit 1
+    ;;
+esac
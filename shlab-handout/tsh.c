@@ -13,6 +13,7 @@
  * SSN: 2205922359
  * === End User Information ===
  */
+#define _GNU_SOURCE         /* for pipe2 and tee */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,27 +22,93 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <termios.h>
+#include <stddef.h>
 #include <errno.h>
+#include <limits.h>
+#include "tshfmt.h"
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXHERE       8   /* max here-documents on a command line */
+#define MAXFAN        8   /* max consumers of a |> fan-out */
+#define MAXVARS     128   /* max shell variables */
+
+/* Timer wheel geometry: 4 levels of 64 slots, 10ms per tick, so the
+ * levels cover 0.64s, 41s, 44min and 46h */
+#define TICK_NS   10000000LL  /* ns per tick */
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELMASK (WHEELSIZE - 1)
+#define WHEELLVLS 4
+
+#define CAPBUF (64*1024)      /* output kept per captured job, bytes */
+
+#define FANCHUNK (64*1024)    /* most a fan-out helper moves at once */
+
+/* Respawn policy */
+#define RS_QUICK    1000000000LL /* a run shorter than this (ns) is a crash */
+#define RS_MAXQUICK 5            /* crashes in a row that make a crash loop */
+#define RS_DELAY    10           /* first backoff delay, ticks (100ms) */
+#define RS_MAXDELAY 3000         /* give up instead of waiting longer (30s) */
+
+/* Token types, see gettok */
+#define T_END   0   /* end of the line */
+#define T_WORD  1   /* a word (argument) */
+#define T_SEMI  2   /* ; */
+#define T_AMP   3   /* & */
+#define T_AND   4   /* && */
+#define T_OR    5   /* || */
+#define T_ERR   6   /* unterminated quote */
+#define T_HERE  7   /* << here-document */
+#define T_HSTR  8   /* <<< here-string */
+#define T_FAN   9   /* |> fan-out */
+#define T_LBRACE 10 /* { after |> */
+#define T_COMMA 11  /* , between fan-out consumers */
+#define T_RBRACE 12 /* } */
+
+/* Node types of a parsed program */
+#define N_CMD   1   /* simple command */
+#define N_FOR   2   /* for name in words; do body; done */
+#define N_WHILE 3   /* while cond; do body; done */
+#define N_IF    4   /* if cond; then body; [elif ...|else elsep;] fi */
+
+/* Pending break or continue, see loopdone */
+#define LOOP_BREAK 1
+#define LOOP_CONT  2
+
+/* How a node is joined to the one before it */
+#define OP_SEQ  0   /* ; & or start of the list: always run */
+#define OP_AND  1   /* &&: run if the previous status was 0 */
+#define OP_OR   2   /* ||: run if it wasn't */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define RS 4    /* died, waiting to be respawned */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ * RS (respawn pending)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     BG -> RS  : a respawn job died and is backing off
+ *     RS -> BG  : its backoff delay is over
  * At most 1 job can be in the FG state.
  */
 
@@ -51,14 +118,150 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+char *cstring = NULL;       /* rest of the -c command string, if any */
+FILE *infile = NULL;        /* where command lines are read from */
+int interactive = 1;        /* false for -c strings and scripts */
+int initdone = 0;           /* signal handlers installed yet? */
+int tailexec = 0;           /* if true, exec the next FG command in place */
+int exitstatus = 0;         /* status of the last command, for $? */
+char synerr[MAXLINE];       /* what the parser last complained about */
+int nocache = 0;            /* if true, don't use the script cache (-C) */
+volatile sig_atomic_t fgstatus = 0; /* how the last FG job exited or stopped */
+int ttyfd = -1;             /* the terminal we control, if stdin is one */
+pid_t shellpgid;            /* our process group, which owns the terminal */
+struct termios shelltmodes; /* our terminal modes, restored after fg jobs */
+struct tshstat *statpage = NULL; /* shared job status page (-m) */
+char tracepath[MAXLINE];    /* where SIGUSR1 dumps the event trace */
+
+struct tshring {            /* The event trace ring */
+    unsigned long long head;   /* events logged so far */
+    struct tshtrace_ev ev[TSHTRACE_NEVENTS];
+};
+struct tshring *evring = NULL; /* shared with our children, see initshell */
+
+struct tmr_t {              /* A timer wheel entry */
+    struct tmr_t *next;     /* slot list links, NULL if not queued */
+    struct tmr_t *prev;
+    unsigned long long expires; /* tick to fire on */
+};
+struct tmr_t wheel[WHEELLVLS][WHEELSIZE]; /* list heads of the slots */
+unsigned long long wheelnow = 0; /* last tick the wheel has processed */
+int ntimers = 0;            /* entries queued on the wheel */
+timer_t wheeltimer;         /* the one kernel timer behind the wheel */
 
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
+    long long start;        /* start time, ns since the epoch */
+    long long cpu;          /* CPU time in us, as of the last stop */
+                            /* (see jobcpu for a running job) */
+    struct tmr_t tmr;       /* timeout deadline, if queued */
+    long long tmrleft;      /* ticks left on the deadline while stopped */
+    int tmrsig;             /* signal to send when it expires */
+    long long killafter;    /* ticks until SIGKILL after that, 0 if none */
+    int timedout;           /* has the deadline passed? */
+    int respawn;            /* relaunch it when it dies? */
+    int maxrestarts;        /* respawn --max, 0 if unlimited */
+    int backoff;            /* respawn --backoff */
+    int restarts;           /* times relaunched so far */
+    int crashes;            /* quick deaths in a row */
+    long long spawned;      /* when the current run started, ns */
+    long long died;         /* when the last run died, ns */
+    long long downtime;     /* total time spent dead, ns */
+    int capwr;              /* write end of its capture pipe, or -1 */
+    int cap;                /* its slot in caps, or -1 (all its runs) */
+    pid_t members[2*MAXFAN]; /* all processes of a fan-out job, leader first */
+    int nmembers;           /* 0 for other jobs */
+    int alive;              /* members not reaped yet */
+    int laststatus;         /* wait status of the last member */
+    int hastmodes;          /* are tmodes set? */
+    struct termios tmodes;  /* terminal modes it stopped with */
+    char *rsargv[MAXARGS];  /* command to relaunch, pointing into rsbuf */
+    char rsbuf[MAXLINE];
     char cmdline[MAXLINE];  /* command line */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+/*
+ * A parsed command line is a flat, pointer-free program: nodes refer
+ * to each other, to their words and to strings by index, so the whole
+ * thing can be copied or stored as is.
+ */
+struct word_t {             /* A word of a command */
+    int str;                /* offset of its text in the string pool */
+    int quoted;             /* was it in single quotes (no expansion)? */
+};
+
+struct node_t {             /* A command in a parsed program */
+    int type;               /* N_CMD, N_FOR, N_WHILE or N_IF */
+    int op;                 /* OP_SEQ, OP_AND or OP_OR */
+    int bg;                 /* ended with '&'? */
+    int neg;                /* prefixed with '!'? */
+    int argc;               /* its words are word[argv] .. word[argv+argc-1] */
+    int argv;               /* (for a loop: the variable, then the list) */
+    int cmdline;            /* offset of its source text in the pool */
+    int in;                 /* word holding its stdin text, or -1 */
+    int fan;                /* first of its |> consumers, or -1 */
+    int cond;               /* while/if: list to test, or -1 */
+    int body;               /* for/while/if: list to run, or -1 */
+    int elsep;              /* if: else list or elif node, or -1 */
+    int next;               /* next node of its list, -1 at the end */
+};
+
+struct prog_t {             /* A parsed program */
+    struct node_t *node;    /* the nodes */
+    int nnode, maxnode;
+    struct word_t *word;    /* the words of all the commands */
+    int nword, maxword;
+    char *str;              /* string pool */
+    int nstr, maxstr;
+};
+
+struct tok_t {              /* A token, as returned by gettok */
+    int type;               /* T_WORD, T_SEMI, ... */
+    char *start;            /* where it starts in the line */
+    char *end;              /* one past its last character */
+    char *text;             /* text of a word, without quotes */
+    int len;
+    int quoted;             /* was the word quoted? */
+};
+
+struct parse_t {            /* State of the parser */
+    struct prog_t *prog;    /* where the nodes go */
+    char *p;                /* where the token after tok starts */
+    struct tok_t tok;       /* the current token */
+    int depth;              /* blocks open; they may span lines */
+    char line[MAXLINE];     /* the line being parsed, after the first */
+    int nhere;              /* here-documents to read at the line end */
+    struct tok_t here[MAXHERE]; /* their delimiters */
+    int herenode[MAXHERE];  /* and commands */
+};
+
+struct var_t {              /* A shell variable */
+    char *name;
+    char *value;
+    size_t size;            /* room at value */
+};
+struct var_t vars[MAXVARS]; /* set by for loops and name=value */
+int nvars = 0;
+int looplevel = 0;          /* loops we are running inside */
+int loopctl = 0;            /* LOOP_BREAK or LOOP_CONT, if pending */
+
+struct cap_t {              /* Captured output of a background job */
+    pid_t pid;              /* job PID, 0 if the slot was never used */
+    int jid;                /* job ID, 0 once a newer job has it */
+    int fd;                 /* read end of the job's pipe, -1 at EOF */
+    int follow;             /* send output straight to stdout? */
+    unsigned long long total; /* bytes captured so far */
+    unsigned long long shown; /* how many of them reached stdout */
+    char *buf;              /* ring holding the last CAPBUF of them */
+};
+struct cap_t caps[MAXJOBS]; /* capture slots, see capstart */
+int capture = 0;            /* if true, capture background job output */
+int capepfd = -1;           /* epoll instance of the capture thread */
+pthread_mutex_t caplock = PTHREAD_MUTEX_INITIALIZER; /* guards caps */
+volatile sig_atomic_t interrupted = 0; /* ctrl-c seen, for logs -f and loops */
 /* End global variables */
 
 
@@ -66,16 +269,52 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+int runcmd(char **argv, int bg, char *cmdline, int tail, int infd, char ***fan);
+int runlist(struct prog_t *prog, int n, int tail);
+int runnode(struct prog_t *prog, int n, int tail);
+int runblock(struct prog_t *prog, int n);
+int loopdone(void);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
+void do_logs(char **argv);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void sigusr1_handler(int sig);
+void sigalrm_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseprog(struct prog_t *prog, char *cmdline);
+int parselist(struct parse_t *ps);
+int parsecmd(struct parse_t *ps, int op);
+int parseblock(struct parse_t *ps);
+int queuehere(struct parse_t *ps, struct tok_t *delim, int n);
+int parsefan(struct parse_t *ps, int n, char **endp);
+int advance(struct parse_t *ps, int fan);
+int iskw(struct parse_t *ps, char *kw);
+int expect(struct parse_t *ps, char *kw);
+int nextline(struct parse_t *ps);
+void readheres(struct parse_t *ps);
+int synerror(struct parse_t *ps);
+int namelen(char *s);
+char *getvar(char *name, int len);
+int setvar(char *name, int len, char *value);
+int gettok(char **pp, struct tok_t *tok, int fan);
+int readhere(struct prog_t *prog, struct tok_t *delim);
+int heredoc(struct prog_t *prog, struct word_t *w);
+void progreset(struct prog_t *prog);
+int addnode(struct prog_t *prog);
+int addword(struct prog_t *prog, char *text, int len, int quoted);
+int addstr(struct prog_t *prog, char *text, int len);
+char *expand(struct prog_t *prog, struct word_t *w, char **bufp, char *end);
+int readcmd(char *cmdline);
+int atend(void);
+void initshell(void);
+void inittrace(void);
+void initterm(void);
+void giveterm(pid_t pid);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
@@ -86,8 +325,51 @@ int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
+struct job_t *getjobmember(struct job_t *jobs, pid_t pid);
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
+void listjobs_json(struct job_t *jobs);
+void openstatus(char *path);
+void publishjobs(struct job_t *jobs);
+long long jobcpu(struct job_t *job);
+int needshell(void);
+long long nowns(void);
+void traceev(int type, pid_t pid, int jid, int arg);
+int dumptrace(char *path);
+
+void tmr_add(struct tmr_t *t, long long ticks);
+void tmr_del(struct tmr_t *t);
+void tmr_run(void);
+void tmr_link(struct tmr_t *t);
+void tmr_arm(void);
+unsigned long long nowtick(void);
+int parsetimeout(char **argv, long long *ticks, int *sig, long long *killafter);
+
+int parserespawn(char **argv, int *max, int *backoff);
+int respawnjob(struct job_t *job);
+int spawnagain(struct job_t *job);
+void execcmd(char **argv, int infd, int outfd);
+int fanout(struct job_t *job, int in, char ***fan, int outfd);
+pid_t fanchild(struct job_t *job);
+void fanhelper(void);
+void saveargv(struct job_t *job, char **argv);
+long long jobdowntime(struct job_t *job);
+
+struct cap_t *capstart(pid_t pid, int jid, int fd);
+struct cap_t *getcap(struct job_t *job);
+struct job_t *capjob(struct cap_t *cap);
+struct cap_t *getoldcap(pid_t pid, int jid);
+void capfollow(struct cap_t *cap, int replay, int on);
+void capwrite(struct cap_t *cap, unsigned long long from);
+ssize_t capread(struct cap_t *cap, size_t max);
+void *capthread(void *arg);
+
+int runscript(char *path);
+int compile(struct prog_t *prog);
+int loadcache(char *path, struct stat *st, struct prog_t *prog);
+void savecache(char *path, struct stat *st, struct prog_t *prog, int root);
+int cachefile(char *path, char *file);
+int checkprog(struct prog_t *prog, int root);
 
 void usage(void);
 void unix_error(char *msg);
@@ -104,12 +386,8 @@ int main(int argc, char **argv)
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
 
-    /* Redirect stderr to stdout (so that driver will get all output
-     * on the pipe connected to stdout) */
-    dup2(1, 2);
-
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpoCc:m:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -120,23 +398,55 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'c':             /* run a command string and exit */
+            cstring = optarg;
+            interactive = 0;
+	    break;
+        case 'o':             /* capture background job output */
+            capture = 1;
+	    break;
+        case 'C':             /* parse scripts line by line, uncached */
+            nocache = 1;
+	    break;
+        case 'm':             /* publish the job list for monitors */
+            openstatus(optarg);
+	    break;
 	default:
             usage();
 	}
     }
 
-    /* Install the signal handlers */
-
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* A remaining argument names a script to run instead of stdin */
+    infile = stdin;
+    if (cstring == NULL && optind < argc) {
+	if ((infile = fopen(argv[optind], "r")) == NULL) {
+	    unix_error(argv[optind]);
+	}
+	interactive = 0;
+    }
 
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler); 
+    /* One-shot runs skip the prompt and all the interactive setup.
+     * The signal handlers are installed by eval the first time it
+     * has to fork, so a lone command is just getopt and execvp; only
+     * the event trace is set up right away. */
+    inittrace();
+    if (interactive) {
+	/* Redirect stderr to stdout (so that driver will get all output
+	 * on the pipe connected to stdout) */
+	dup2(1, 2);
+	initshell();
+    }
+    else {
+	emit_prompt = 0;
+    }
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* A script is compiled as a whole (or loaded from the cache) and
+     * run in one go. One with a syntax error runs line by line, so it
+     * gets as far as it would have. */
+    if (infile != stdin && !nocache && runscript(argv[optind])) {
+	fflush(stdout);
+	exit(exitstatus);
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -146,14 +456,14 @@ int main(int argc, char **argv)
 	    printf("%s", prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin)) {
-	    app_error("fgets error");
-	}
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	if (!readcmd(cmdline)) { /* End of file (ctrl-d) */
 	    fflush(stdout);
-	    exit(0);
+	    exit(exitstatus);
 	}
 
+	/* The last line of a -c string or script can replace the shell */
+	tailexec = !interactive && atend();
+
 	/* Evaluate the command line */
 	eval(cmdline);
 	fflush(stdout);
@@ -163,9 +473,326 @@ int main(int argc, char **argv)
     exit(0); /* control never reaches here */
 }
   
+/*
+ * inittrace - Map the event trace ring and install the SIGUSR1 handler
+ *    that dumps it. Done first thing, even for one-shot runs, so that
+ *    the trace is always on: a single mmap costs next to nothing.
+ */
+void inittrace(void)
+{
+    /* The event trace ring is mapped shared so that children can log
+     * their exec (or exec failure) where the shell will see it */
+    evring = mmap(NULL, sizeof(struct tshring), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (evring == MAP_FAILED) {
+	unix_error("mmap error");
+    }
+    if (getenv("TSH_TRACE") != NULL) {
+	snprintf(tracepath, MAXLINE, "%s", getenv("TSH_TRACE"));
+    }
+    else {
+	/* rather the user's own runtime directory than the shared /tmp */
+	snprintf(tracepath, MAXLINE, "%s/tsh.%d.trace",
+		 getenv("XDG_RUNTIME_DIR") != NULL ? getenv("XDG_RUNTIME_DIR") : "/tmp",
+		 (int)getpid());
+    }
+    Signal(SIGUSR1, sigusr1_handler);  /* dump the event trace */
+}
+
+/*
+ * initshell - Install the signal handlers and initialize the job list
+ */
+void initshell(void)
+{
+    if (initdone) {
+	return;
+    }
+    initdone = 1;
+
+    /* Install the signal handlers */
+
+    /* These are the ones you will need to implement */
+    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
+    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
+    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+
+    /* This one provides a clean way to kill the shell */
+    Signal(SIGQUIT, sigquit_handler); 
+
+    /* Take charge of the terminal, if we have one */
+    if (isatty(STDIN_FILENO)) {
+	initterm();
+    }
+
+    /* One kernel timer drives every timeout deadline */
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &wheeltimer) < 0) {
+	unix_error("timer_create error");
+    }
+    Signal(SIGALRM, sigalrm_handler);  /* timeout deadlines */
+
+    /* Initialize the job list */
+    initjobs(jobs);
+}
+
+/*
+ * initterm - Make the shell the foreground process group of its
+ *    terminal, so that it can hand the terminal to foreground jobs
+ *    (see waitfg). If we were started in the background, wait until
+ *    we are brought to the foreground first. A script or -c string
+ *    only borrows the terminal, if it has it at all, and gives it
+ *    back to the group it was started in.
+ */
+void initterm(void)
+{
+    if (!interactive) {
+	if (tcgetpgrp(STDIN_FILENO) != (shellpgid = getpgrp()) ||
+	    tcgetattr(STDIN_FILENO, &shelltmodes) < 0) {
+	    return;
+	}
+	Signal(SIGTTOU, SIG_IGN);
+	Signal(SIGTTIN, SIG_IGN);
+	ttyfd = STDIN_FILENO;
+	return;
+    }
+
+    while (tcgetpgrp(STDIN_FILENO) != (shellpgid = getpgrp())) {
+	kill(-shellpgid, SIGTTIN);
+    }
+
+    /* Switching the terminal around must not stop us */
+    Signal(SIGTTOU, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+
+    shellpgid = getpid();
+    if (getpgrp() != shellpgid && setpgid(0, shellpgid) < 0) {
+	unix_error("setpgid error");
+    }
+    if (tcsetpgrp(STDIN_FILENO, shellpgid) < 0 ||
+	tcgetattr(STDIN_FILENO, &shelltmodes) < 0) {
+	unix_error("terminal setup error");
+    }
+    ttyfd = STDIN_FILENO;
+}
+
+/*
+ * giveterm - Hand the terminal, if we have one, to the job pid, in the
+ *    modes it was stopped with. This must happen before a stopped job
+ *    is continued: one that redraws on SIGCONT would otherwise stop
+ *    again on SIGTTOU, or have its modes overwritten afterwards.
+ */
+void giveterm(pid_t pid)
+{
+    struct job_t *job;
+
+    if (ttyfd == -1 || (job = getjobpid(jobs, pid)) == NULL) {
+	return;
+    }
+    if (job->hastmodes) {
+	tcsetattr(ttyfd, TCSADRAIN, &job->tmodes);
+    }
+    tcsetpgrp(ttyfd, pid);
+}
+
 /* 
  * eval - Evaluate the command line that the user has just typed in
  * 
+ * The line is parsed into a list of commands joined by ;, &, && and
+ * ||, which runlist then runs one by one, in the shell.
+ */
+void eval(char *cmdline) 
+{
+    static struct prog_t prog; /* reused from line to line */
+    int root;
+
+    interrupted = 0;
+    progreset(&prog);
+    if((root = parseprog(&prog, cmdline)) < 0){
+	if(root == -2){
+	    printf("%s\n", synerr);
+	    exitstatus = 2;
+	}
+	return;
+    }
+    runlist(&prog, root, tailexec);
+}
+
+/*
+ * runlist - Run the list of nodes starting at n, skipping the ones
+ *    whose && or || doesn't hold. Lists are evaluated left to right,
+ *    so "a && b || c" means "(a && b) || c". If tail is set, the last
+ *    command may replace the shell. Returns the list's exit status.
+ */
+int runlist(struct prog_t *prog, int n, int tail)
+{
+    struct node_t *np;
+
+    //a break or continue skips the rest of the list
+    for(; n >= 0 && loopctl == 0; n = np->next){
+	np = &prog->node[n];
+	if((np->op == OP_AND && exitstatus != 0) ||
+	   (np->op == OP_OR && exitstatus == 0)){
+	    continue;
+	}
+	runnode(prog, n, tail && np->next < 0);
+    }
+    return exitstatus;
+}
+
+/*
+ * runnode - Expand the words of node n and run it, setting exitstatus
+ */
+int runnode(struct prog_t *prog, int n, int tail)
+{
+    static char buf[MAXLINE];   /* expanded words */
+    static char *fanargv[MAXFAN][MAXARGS];
+    struct node_t *np = &prog->node[n], *cp;
+    char *argv[MAXARGS];
+    char **fan[MAXFAN + 1];
+    char *bp = buf;
+    int i, j, c, status, infd = -1;
+
+    if(np->type != N_CMD){
+	status = runblock(prog, n);
+	if(np->neg){
+	    status = !status;
+	}
+	return exitstatus = status;
+    }
+
+    for(i = 0; i < np->argc; i++){
+	if((argv[i] = expand(prog, &prog->word[np->argv + i], &bp, buf + MAXLINE)) == NULL){
+	    printf("Command line too long\n");
+	    return exitstatus = 1;
+	}
+    }
+    argv[i] = NULL;
+
+    //and those of its |> consumers
+    for(i = 0, c = np->fan; c >= 0 && i < MAXFAN; c = cp->next, i++){
+	cp = &prog->node[c];
+	for(j = 0; j < cp->argc; j++){
+	    if((fanargv[i][j] = expand(prog, &prog->word[cp->argv + j], &bp, buf + MAXLINE)) == NULL){
+		printf("Command line too long\n");
+		return exitstatus = 1;
+	    }
+	}
+	fanargv[i][j] = NULL;
+	fan[i] = fanargv[i];
+    }
+    fan[i] = NULL;
+
+    //a here-document or here-string becomes the command's stdin
+    if(np->in >= 0 && (infd = heredoc(prog, &prog->word[np->in])) == -1){
+	printf("here-document: %s\n", strerror(errno));
+	return exitstatus = 1;
+    }
+
+    status = runcmd(argv, np->bg, prog->str + np->cmdline, tail && !np->neg && np->fan < 0,
+		    infd, np->fan >= 0 ? fan : NULL);
+    if(infd != -1){
+	close(infd);
+    }
+    if(np->neg){
+	status = !status;
+    }
+    return exitstatus = status;
+}
+
+/*
+ * runblock - Run the for, while or if block at node n, in the shell,
+ *    and return its exit status. A loop also stops at a break, or
+ *    once ctrl-c has reached the shell or killed a foreground job
+ *    since the outermost loop started; its status is 130 then, as if
+ *    ctrl-c had killed the loop.
+ */
+int runblock(struct prog_t *prog, int n)
+{
+    struct node_t *np = &prog->node[n];
+    char buf[MAXLINE], *items[MAXARGS], *bp = buf;
+    struct word_t *name;
+    int i, count, status = 0;
+
+    switch(np->type){
+    case N_IF:
+	runlist(prog, np->cond, 0);
+	if(loopctl != 0){
+	    return exitstatus;
+	}
+	if(exitstatus == 0){
+	    return runlist(prog, np->body, 0);
+	}
+	return np->elsep >= 0 ? runlist(prog, np->elsep, 0) : 0;
+
+    case N_FOR:
+	//the list is expanded once, up front
+	name = &prog->word[np->argv];
+	for(count = 0; count < np->argc - 1; count++){
+	    if((items[count] = expand(prog, name + 1 + count, &bp, buf + MAXLINE)) == NULL){
+		printf("Command line too long\n");
+		return 1;
+	    }
+	}
+	if(looplevel++ == 0){ //a ctrl-c seen before doesn't count
+	    interrupted = 0;
+	}
+	for(i = 0; i < count; i++){
+	    if(setvar(prog->str + name->str, strlen(prog->str + name->str), items[i]) < 0){
+		status = 1;
+		break;
+	    }
+	    status = runlist(prog, np->body, 0);
+	    if(loopdone()){
+		break;
+	    }
+	}
+	looplevel--;
+	return interrupted ? 128 + SIGINT : status;
+
+    case N_WHILE:
+	if(looplevel++ == 0){ //a ctrl-c seen before doesn't count
+	    interrupted = 0;
+	}
+	while(1){
+	    runlist(prog, np->cond, 0);
+	    if(loopctl == 0 && exitstatus != 0){
+		break;
+	    }
+	    if(loopctl == 0){
+		status = runlist(prog, np->body, 0);
+	    }
+	    if(loopdone()){
+		break;
+	    }
+	}
+	looplevel--;
+	return interrupted ? 128 + SIGINT : status;
+    }
+    return 1;
+}
+
+/*
+ * loopdone - Called after each pass of a loop: return true if it must
+ *    stop. A break or continue applies to this loop only, so it is
+ *    cleared here.
+ */
+int loopdone(void)
+{
+    int ctl = loopctl;
+
+    loopctl = 0;
+    return ctl == LOOP_BREAK || interrupted;
+}
+
+/* 
+ * runcmd - Run one simple command and return its exit status. If infd
+ *    isn't -1 it is the command's stdin (the caller closes it). If fan
+ *    isn't NULL, the command's output goes to each of the consumers in
+ *    it, a NULL terminated list of argvs (see fanout).
+ * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
  * then execute it immediately. Otherwise, fork a child process and
  * run the job in the context of the child. If the job is running in
@@ -174,9 +801,8 @@ int main(int argc, char **argv)
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
  */
-void eval(char *cmdline) 
+int runcmd(char **argv, int bg, char *cmdline, int tail, int infd, char ***fan) 
 {
-    int bg;
     pid_t pid;
 
     //Defining a set that will contain the signals to be blocked
@@ -186,35 +812,100 @@ void eval(char *cmdline)
     //in this document are included 
     if(sigfillset(&blockMask) == -1){
 	printf("Erorr!");
-	return;
+	return 1;
     }
     //Make sure to add SIGCHLD to the set
     if(sigaddset(&blockMask, SIGCHLD) == -1){
 	printf("Erorr!");
-	return;
+	return 1;
     }
     
-    //create the argument array
-    char *argv[MAXARGS];
-
-    //breake down the command line argument into the arrray
-    bg = parseline(cmdline, argv);
-    //if parseline returns -1, error.
-    if(bg == -1){
-	printf("Erorr!");
-	return;
-    }
     //get the job structure
     struct job_t *job;
+    struct cap_t *cap;
+
+    //a timeout prefix gives the job a deadline, tracked by the shell
+    long long tmrticks = 0, killafter = 0;
+    int tmrsig = SIGTERM;
+    char **cmdargv = argv;
+    if(strcmp(argv[0], "timeout") == 0){
+	int n = parsetimeout(argv, &tmrticks, &tmrsig, &killafter);
+	if(n == 0){
+	    return 1;
+	}
+	cmdargv = &argv[n];
+    }
+
+    //a respawn prefix keeps relaunching the job when it dies
+    int respawn = 0, maxrestarts = 0, backoff = 0;
+    if(strcmp(argv[0], "respawn") == 0){
+	int n = parserespawn(argv, &maxrestarts, &backoff);
+	if(n == 0){
+	    return 1;
+	}
+	if(!bg){
+	    printf("respawn: the job must run in the background\n");
+	    return 1;
+	}
+	if(strcmp(argv[n], "timeout") == 0){
+	    printf("respawn: can't be combined with timeout\n");
+	    return 1;
+	}
+	if(infd != -1){
+	    printf("respawn: can't read a here-document\n");
+	    return 1;
+	}
+	if(fan != NULL){
+	    printf("respawn: can't be combined with |>\n");
+	    return 1;
+	}
+	respawn = 1;
+	cmdargv = &argv[n];
+    }
 
     //check if the command from the user is a built-in command
     //if it's not, then create a child process to handle the command.
-    if(!builtin_cmd(argv)) {
+    //Builtins set exitstatus themselves when they fail.
+    exitstatus = 0;
+    if(cmdargv != argv || fan != NULL || !builtin_cmd(argv)) {
+
+	//Nothing is left to do after the last foreground command of a -c
+	//string or script, so run it in place instead of forking. Not
+	//while a background job still needs the shell though
+	if(tail && !bg && cmdargv == argv && !needshell()){
+	    fflush(stdout);
+	    execcmd(argv, infd, -1);
+	}
+
+	//one-shot runs only set up job control once they need it
+	initshell();
+
+	//with -o a background job writes into a pipe that the capture
+	//thread drains into the job's ring buffer
+	int cappipe[2] = { -1, -1 };
+	if(capture && bg && pipe2(cappipe, O_CLOEXEC | O_NONBLOCK) == -1){
+	     printf("pipe: %s\n", strerror(errno));
+	     return 1;
+	}
+
+	//with |> the command writes into a pipe that fanout spreads
+	int fanpipe[2] = { -1, -1 };
+	if(fan != NULL && pipe2(fanpipe, O_CLOEXEC) == -1){
+	     printf("pipe: %s\n", strerror(errno));
+	     if(cappipe[0] != -1){
+		 close(cappipe[0]);
+		 close(cappipe[1]);
+	     }
+	     return 1;
+	}
+
+	//whatever earlier commands of the line printed goes out first
+	fflush(stdout);
 
 	//block SIGCHLD signals before it forks the child
 	if(sigprocmask(SIG_BLOCK, &blockMask, NULL) == -1){
 	     printf("Erorr!");
-             return;
+             return 1;
         }
 	
 	if((pid = fork()) == 0) { //The child
@@ -222,33 +913,101 @@ void eval(char *cmdline)
 	    //Set the child process group id
             if(setpgid(0, 0) == -1){
 		printf("Erorr!");
-		return;
+		return 1;
+	    }
+	    //a foreground job takes the terminal (the shell does it too,
+	    //whichever of us gets there first)
+	    if(ttyfd != -1 && !bg){
+		tcsetpgrp(ttyfd, getpid());
 	    }
 
 	    //unblock signals
 	    if(sigprocmask(SIG_UNBLOCK, &blockMask, NULL) == -1){
 		printf("Erorr!");
-           	return;
+           	return 1;
             }
 
-	     //if the command is not buil tin  we need to break the command down    
-            if(execvp(argv[0], argv) == (-1)) {
-		//If the command is not found we print error message to the user
-		printf("%s: Command not found\n", argv[0]);
-		exit(0);
+	    //only the consumers of a fan-out write to the capture pipe
+	    if(fanpipe[1] != -1){
+		dup2(fanpipe[1], 1);
+		execcmd(cmdargv, infd, -1);
 	    }
+
+	     //if the command is not buil tin  we need to break the command down    
+	    execcmd(cmdargv, infd, cappipe[1]);
+	}
+	traceev(EV_FORK, pid, 0, 0);
+	if(fan != NULL){
+	     //the consumers join its group, which must exist by then
+	     setpgid(pid, pid);
 	}
 
 	//Check if the process is in the foreground or background and add it accordingly
 	//if addjob returns 0 then it tried to make to many jobs
 	if(addjob(jobs, pid, bg ? BG : FG, cmdline) == 0){
 	     printf("Erorr!");
-	     return;
+	     return 1;
+	}
+	job = getjobpid(jobs, pid);
+	if(fan != NULL){
+	     close(fanpipe[1]);
+	     //on failure the job is killed, and reaped like any other;
+	     //a foreground one must be gone before the next command
+	     if(fanout(job, fanpipe[0], fan, cappipe[1]) < 0){
+		 if(cappipe[0] != -1){
+		     close(cappipe[0]);
+		     close(cappipe[1]);
+		 }
+		 sigprocmask(SIG_UNBLOCK, &blockMask, NULL);
+		 if(!bg){
+		     waitfg(pid);
+		 }
+		 return exitstatus = 1;
+	     }
+	}
+	if(respawn){
+	     job->respawn = 1;
+	     job->maxrestarts = maxrestarts;
+	     job->backoff = backoff;
+	     job->spawned = nowns();
+	     job->capwr = -1;
+	     saveargv(job, cmdargv);
+	}
+	if(cappipe[0] != -1){
+	     //a respawn job's next run writes into the same pipe, so the
+	     //shell holds on to the write end for it
+	     if(respawn){
+		 job->capwr = cappipe[1];
+	     } else {
+		 close(cappipe[1]);
+	     }
+	     if((cap = capstart(pid, job->jid, cappipe[0])) == NULL){
+		 close(cappipe[0]);
+	     } else {
+		 job->cap = cap - caps;
+	     }
+	}
+	//start the deadline clock while signals are still blocked
+	if(tmrticks > 0){
+	     job = getjobpid(jobs, pid);
+	     job->tmrsig = tmrsig;
+	     job->killafter = killafter;
+	     tmr_add(&job->tmr, tmrticks);
+	}
+	//If it's in the backgound, we print it to the user. This has to
+	//happen before SIGCHLD is unblocked, or a short job may already
+	//be reaped and gone from the list.
+	if(bg){
+	     job = getjobpid(jobs, pid);
+	     printf("[%d] (%d) %s", job->jid, job->pid, cmdline); 
+	}
+	if(!bg){
+	     giveterm(pid);
 	}
 	//unblock signals after adding a job to jobs.
 	if(sigprocmask(SIG_UNBLOCK, &blockMask, NULL) == -1){
 	     printf("Erorr!");
-             return;
+             return 1;
         }
 
 	//If it's in the foreground we wait until it's no longer
@@ -256,91 +1015,877 @@ void eval(char *cmdline)
 	if(!bg){
 	     waitfg(pid);
 	}
-	else{
-	     //If it's in the backgound, we print it to the user
-	     job = getjobpid(jobs, pid);
-	     printf("[%d] (%d) %s", job->jid, job->pid, cmdline); 
-	}
 	
     }
     
-    return;
+    return exitstatus;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+/*
+ * parseprog - Parse a command line into prog, after whatever prog
+ *    already holds. A for, while or if block left open goes on over
+ *    the following lines (see nextline). Return the index of the first
+ *    node, -1 for a blank line, or -2 with the reason in synerr.
  */
-int parseline(const char *cmdline, char **argv) 
+int parseprog(struct prog_t *prog, char *cmdline)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) { /* ignore leading spaces */
-	buf++;
+    struct parse_t ps;
+    int root, nnode = prog->nnode;
+
+    ps.prog = prog;
+    ps.p = cmdline;
+    ps.depth = 0;
+    ps.nhere = 0;
+    advance(&ps, 0);
+    //the bodies of the line's here-documents go, even on an error
+    if((root = parselist(&ps)) == -2){
+	readheres(&ps);
+	return -2;
     }
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
+    if(ps.tok.type != T_END){
+	synerror(&ps);
+	readheres(&ps);
+	return -2;
     }
-    else {
-	delim = strchr(buf, ' ');
+    readheres(&ps);
+
+    //a lone command keeps the line exactly as typed for the job list
+    if(prog->nnode == nnode + 1 && prog->node[root].type == N_CMD){
+	prog->node[root].cmdline = addstr(prog, cmdline, strlen(cmdline));
     }
+    return root;
+}
 
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) { /* ignore spaces */
-	    buf++;
+/*
+ * parselist - Parse commands joined by ; & && and ||, up to the end of
+ *    the line, or inside a block up to one of the keywords that ends
+ *    it. Return the index of the first node, -1 if there were none,
+ *    or -2 with the reason in synerr.
+ */
+int parselist(struct parse_t *ps)
+{
+    struct prog_t *prog = ps->prog;
+    int first = -1, last = -1, n, op = OP_SEQ;
+
+    while(1){
+	//inside a block a newline is just a separator
+	while(ps->tok.type == T_END && ps->depth > 0){
+	    if(nextline(ps) < 0){
+		return -2;
+	    }
+	}
+	if(ps->tok.type == T_END || iskw(ps, "do") || iskw(ps, "done") ||
+	   iskw(ps, "then") || iskw(ps, "elif") || iskw(ps, "else") || iskw(ps, "fi")){
+	    //but && and || need something after them
+	    return op == OP_SEQ ? first : synerror(ps);
 	}
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
+	if((n = parsecmd(ps, op)) < 0){
+	    return -2;
 	}
-	else {
-	    delim = strchr(buf, ' ');
+	if(last >= 0){
+	    prog->node[last].next = n;
+	} else {
+	    first = n;
+	}
+	last = n;
+
+	//what joins it to the next one
+	switch(ps->tok.type){
+	case T_AMP:
+	    if(prog->node[n].type != N_CMD){
+		snprintf(synerr, MAXLINE, "syntax error: a block can't run in the background");
+		return -2;
+	    }
+	    prog->node[n].bg = 1;
+	    /* fall through */
+	case T_SEMI:
+	    op = OP_SEQ;
+	    advance(ps, 0);
+	    break;
+	case T_AND:
+	    op = OP_AND;
+	    advance(ps, 0);
+	    break;
+	case T_OR:
+	    op = OP_OR;
+	    advance(ps, 0);
+	    break;
+	case T_END:
+	    op = OP_SEQ;
+	    break;
+	default:
+	    return synerror(ps);
 	}
     }
-    argv[argc] = NULL;
-    
-    if (argc == 0) { /* ignore blank line */
-	return 1;
-    }
-
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
-    }
-    return bg;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
+/*
+ * parsecmd - Parse one command into a node joined to the one before
+ *    it by op: optional '!'s, then a block, or words with a << or <<<
+ *    anywhere and maybe a |> fan-out. Return its index or -2.
+ */
+int parsecmd(struct parse_t *ps, int op)
+{
+    struct prog_t *prog = ps->prog;
+    struct node_t *np;
+    struct tok_t in;
+    char text[MAXLINE];
+    char *start = ps->tok.start, *end = ps->tok.start;
+    int n = -1, neg = 0, redir = 0, want = 0;
+
+    while(ps->tok.type == T_WORD && !ps->tok.quoted && ps->tok.len == 1 && ps->tok.text[0] == '!'){
+	neg = !neg;
+	advance(ps, 0);
+    }
+    if(iskw(ps, "for") || iskw(ps, "while") || iskw(ps, "if")){
+	if((n = parseblock(ps)) < 0){
+	    return -2;
+	}
+	prog->node[n].op = op;
+	prog->node[n].neg = neg;
+	return n;
+    }
+
+    while(1){
+	if((ps->tok.type == T_HERE || ps->tok.type == T_HSTR) && !want){
+	    want = ps->tok.type;
+	    advance(ps, 0);
+	    continue;
+	}
+	if(ps->tok.type != T_WORD){
+	    break;
+	}
+	end = ps->tok.end;
+	if(want){ //the delimiter or the text
+	    //only the last input counts, as in sh, but an earlier here-
+	    //document's body must still be read, or its lines would run
+	    if(redir == T_HERE && queuehere(ps, &in, -1) < 0){
+		return -2;
+	    }
+	    redir = want;
+	    in = ps->tok;
+	    want = 0;
+	    advance(ps, 0);
+	    continue;
+	}
+	if(n < 0){
+	    n = addnode(prog);
+	    np = &prog->node[n];
+	    np->type = N_CMD;
+	    np->op = op;
+	    np->neg = neg;
+	    np->argv = prog->nword;
+	}
+	np = &prog->node[n];
+	if(np->argc == MAXARGS - 1){
+	    snprintf(synerr, MAXLINE, "Too many arguments");
+	    return -2;
+	}
+	addword(prog, ps->tok.text, ps->tok.len, ps->tok.quoted);
+	np->argc++;
+	advance(ps, 0);
+    }
+    if(n < 0 || want){
+	return synerror(ps);
+    }
+
+    //cmd |> {c1, c2, ...}
+    if(ps->tok.type == T_FAN && parsefan(ps, n, &end) < 0){
+	return -2;
+    }
+
+    //keep its source text for the job list
+    if(ps->tok.type == T_AMP){
+	end = ps->tok.end;
+    }
+    snprintf(text, MAXLINE, "%.*s\n", (int)(end - start), start);
+    prog->node[n].cmdline = addstr(prog, text, strlen(text));
+
+    //its input: a here-string now, a here-document after this line
+    if(redir == T_HSTR){
+	snprintf(text, MAXLINE, "%.*s\n", in.len, in.text);
+	prog->node[n].in = addword(prog, text, strlen(text), in.quoted);
+    } else if(redir == T_HERE && queuehere(ps, &in, n) < 0){
+	return -2;
+    }
+    return n;
+}
+
+/*
+ * queuehere - Read the here-document with delimiter delim once this
+ *    line is parsed, as the input of node n (or nowhere if n is -1).
+ *    0, or -2 with the reason in synerr.
+ */
+int queuehere(struct parse_t *ps, struct tok_t *delim, int n)
+{
+    if(ps->nhere == MAXHERE){
+	snprintf(synerr, MAXLINE, "Too many here-documents");
+	return -2;
+    }
+    ps->here[ps->nhere] = *delim;
+    ps->herenode[ps->nhere++] = n;
+    return 0;
+}
+
+/*
+ * parseblock - Parse a for, while, if (or elif) block, from its keyword
+ *    to the one that closes it. Its parts are lists of their own, which
+ *    only point forward, like every other link. Return its index or -2.
+ */
+int parseblock(struct parse_t *ps)
+{
+    struct prog_t *prog = ps->prog;
+    char kw[8];
+    int n, l;
+
+    snprintf(kw, sizeof(kw), "%.*s\n", ps->tok.len, ps->tok.text);
+    n = addnode(prog);
+    prog->node[n].cmdline = addstr(prog, kw, strlen(kw));
+    ps->depth++;
+    advance(ps, 0);
+
+    if(strcmp(kw, "for\n") == 0){
+	//the variable, then the words after "in"
+	prog->node[n].type = N_FOR;
+	if(ps->tok.type != T_WORD || ps->tok.quoted || namelen(ps->tok.text) != ps->tok.len){
+	    return synerror(ps);
+	}
+	prog->node[n].argv = addword(prog, ps->tok.text, ps->tok.len, 1);
+	prog->node[n].argc = 1;
+	advance(ps, 0);
+	if(!iskw(ps, "in")){
+	    return synerror(ps);
+	}
+	advance(ps, 0);
+	while(ps->tok.type == T_WORD){
+	    if(prog->node[n].argc == MAXARGS - 1){
+		snprintf(synerr, MAXLINE, "Too many arguments");
+		return -2;
+	    }
+	    addword(prog, ps->tok.text, ps->tok.len, ps->tok.quoted);
+	    prog->node[n].argc++;
+	    advance(ps, 0);
+	}
+	if(ps->tok.type == T_SEMI){
+	    advance(ps, 0);
+	}
+    } else if(strcmp(kw, "while\n") == 0){
+	prog->node[n].type = N_WHILE;
+	if((l = parselist(ps)) < 0){
+	    return l == -1 ? synerror(ps) : -2;
+	}
+	prog->node[n].cond = l;
+    } else { //if or elif
+	prog->node[n].type = N_IF;
+	if((l = parselist(ps)) < 0){
+	    return l == -1 ? synerror(ps) : -2;
+	}
+	prog->node[n].cond = l;
+	if(expect(ps, "then") < 0 || (l = parselist(ps)) < 0){
+	    return l == -1 ? synerror(ps) : -2;
+	}
+	prog->node[n].body = l;
+	if(iskw(ps, "elif")){
+	    //an elif is an if in the else part, and ends with the fi
+	    if((l = parseblock(ps)) < 0){
+		return -2;
+	    }
+	    prog->node[n].elsep = l;
+	} else {
+	    if(iskw(ps, "else")){
+		advance(ps, 0);
+		if((l = parselist(ps)) < 0){
+		    return l == -1 ? synerror(ps) : -2;
+		}
+		prog->node[n].elsep = l;
+	    }
+	    if(expect(ps, "fi") < 0){
+		return -2;
+	    }
+	}
+	ps->depth--;
+	return n;
+    }
+
+    //the body of a loop
+    l = -2;
+    if(expect(ps, "do") < 0 || (l = parselist(ps)) < 0){
+	return l == -1 ? synerror(ps) : -2;
+    }
+    prog->node[n].body = l;
+    if(expect(ps, "done") < 0){
+	return -2;
+    }
+    ps->depth--;
+    return n;
+}
+
+/*
+ * parsefan - Parse the "{c1, c2, ...}" that follows "cmd |>". The
+ *    consumers become nodes of their own, linked from node n's fan.
+ *    Leave the end of the '}' in *endp. Return 0, or -2.
+ */
+int parsefan(struct parse_t *ps, int n, char **endp)
+{
+    struct prog_t *prog = ps->prog;
+    char text[MAXLINE];
+    char *start = NULL, *end = NULL;
+    int c, last = -1, count = 0;
+
+    if(advance(ps, 1) != T_LBRACE){
+	return synerror(ps);
+    }
+    do {
+	c = -1;
+	while(advance(ps, 1) == T_WORD){
+	    if(c < 0){
+		if(++count > MAXFAN){
+		    snprintf(synerr, MAXLINE, "Too many consumers for |>");
+		    return -2;
+		}
+		c = addnode(prog);
+		prog->node[c].type = N_CMD;
+		prog->node[c].argv = prog->nword;
+		start = ps->tok.start;
+	    }
+	    if(prog->node[c].argc == MAXARGS - 1){
+		snprintf(synerr, MAXLINE, "Too many arguments");
+		return -2;
+	    }
+	    addword(prog, ps->tok.text, ps->tok.len, ps->tok.quoted);
+	    prog->node[c].argc++;
+	    end = ps->tok.end;
+	}
+	if(c < 0 || (ps->tok.type != T_COMMA && ps->tok.type != T_RBRACE)){
+	    return synerror(ps);
+	}
+	snprintf(text, MAXLINE, "%.*s\n", (int)(end - start), start);
+	prog->node[c].cmdline = addstr(prog, text, strlen(text));
+	if(last >= 0){
+	    prog->node[last].next = c;
+	} else {
+	    prog->node[n].fan = c;
+	}
+	last = c;
+    } while(ps->tok.type == T_COMMA);
+
+    *endp = ps->tok.end;
+    advance(ps, 0);
+    return 0;
+}
+
+/* advance - Scan the next token into ps->tok and return its type */
+int advance(struct parse_t *ps, int fan)
+{
+    return gettok(&ps->p, &ps->tok, fan);
+}
+
+/* iskw - Is the current token the (unquoted) keyword kw? */
+int iskw(struct parse_t *ps, char *kw)
+{
+    return ps->tok.type == T_WORD && !ps->tok.quoted &&
+	ps->tok.len == (int)strlen(kw) && strncmp(ps->tok.text, kw, ps->tok.len) == 0;
+}
+
+/* expect - Skip newlines, then the keyword kw, or fail with -2 */
+int expect(struct parse_t *ps, char *kw)
+{
+    while(ps->tok.type == T_END){
+	if(nextline(ps) < 0){
+	    return -2;
+	}
+    }
+    if(!iskw(ps, kw)){
+	return synerror(ps);
+    }
+    advance(ps, 0);
+    return 0;
+}
+
+/*
+ * nextline - Go on parsing on the next input line, once the here-
+ *    documents of this one are read. -2 at the end of the input.
+ */
+int nextline(struct parse_t *ps)
+{
+    readheres(ps);
+    if(!readcmd(ps->line)){
+	snprintf(synerr, MAXLINE, "syntax error: unexpected end of file");
+	return -2;
+    }
+    ps->p = ps->line;
+    advance(ps, 0);
+    return 0;
+}
+
+/* readheres - Read the bodies of the here-documents of this line */
+void readheres(struct parse_t *ps)
+{
+    int i, n;
+
+    for(i = 0; i < ps->nhere; i++){
+	n = readhere(ps->prog, &ps->here[i]);
+	if(ps->herenode[i] >= 0){
+	    ps->prog->node[ps->herenode[i]].in = n;
+	}
+    }
+    ps->nhere = 0;
+}
+
+/* synerror - Complain about the current token in synerr; returns -2 */
+int synerror(struct parse_t *ps)
+{
+    struct tok_t *tok = &ps->tok;
+
+    if(tok->type == T_ERR){
+	snprintf(synerr, MAXLINE, "syntax error: unterminated quote");
+    } else if(tok->type == T_END){
+	snprintf(synerr, MAXLINE, "syntax error: unexpected end of line");
+    } else {
+	snprintf(synerr, MAXLINE, "syntax error near '%.*s'", (int)(tok->end - tok->start), tok->start);
+    }
+    return -2;
+}
+
+/*
+ * gettok - Scan the next token of the line at *pp into tok and return
+ *    its type. Words are separated by blanks and the operators ; & &&
+ *    || << <<< and |>, and in the braces after |> (fan is set) by
+ *    { , and } too. A word starting with a single quote runs to the
+ *    next one.
+ *    A # at the start of a word comments out the rest of the line.
+ */
+int gettok(char **pp, struct tok_t *tok, int fan)
+{
+    char *p = *pp;
+
+    p += strspn(p, " \t");
+    if(*p == '#'){
+	p += strcspn(p, "\n");
+    }
+    tok->start = p;
+    tok->quoted = 0;
+    tok->text = NULL;
+    tok->len = 0;
+    if(*p == '\0' || *p == '\n'){
+	tok->type = T_END;
+    } else if(*p == ';'){
+	tok->type = T_SEMI;
+	p++;
+    } else if(p[0] == '&' && p[1] == '&'){
+	tok->type = T_AND;
+	p += 2;
+    } else if(*p == '&'){
+	tok->type = T_AMP;
+	p++;
+    } else if(p[0] == '|' && p[1] == '|'){
+	tok->type = T_OR;
+	p += 2;
+    } else if(p[0] == '|' && p[1] == '>'){
+	tok->type = T_FAN;
+	p += 2;
+    } else if(fan && strchr("{,}", *p)){
+	tok->type = *p == '{' ? T_LBRACE : *p == ',' ? T_COMMA : T_RBRACE;
+	p++;
+    } else if(p[0] == '<' && p[1] == '<' && p[2] == '<'){
+	tok->type = T_HSTR;
+	p += 3;
+    } else if(p[0] == '<' && p[1] == '<'){
+	tok->type = T_HERE;
+	p += 2;
+    } else if(*p == '\''){
+	tok->type = T_WORD;
+	tok->quoted = 1;
+	tok->text = ++p;
+	if((p = strchr(p, '\'')) == NULL){
+	    tok->type = T_ERR;
+	    p = tok->text;
+	} else {
+	    tok->len = p++ - tok->text;
+	}
+    } else {
+	tok->type = T_WORD;
+	tok->text = p;
+	while(*p && !strchr(" \t\n;&", *p) && !(p[0] == '|' && strchr("|>", p[1])) &&
+	      !(p[0] == '<' && p[1] == '<') && !(fan && strchr("{,}", *p))){
+	    p++;
+	}
+	tok->len = p - tok->text;
+    }
+    tok->end = p;
+    *pp = p;
+    return tok->type;
+}
+
+/*
+ * readhere - Read the lines after the current one as the body of a
+ *    here-document, up to a line that is just delim or the end of the
+ *    input. The body is a word of prog, expanded like the others unless
+ *    delim was quoted. Return its index.
+ */
+int readhere(struct prog_t *prog, struct tok_t *delim)
+{
+    char line[MAXLINE];
+    char *body = NULL;
+    size_t len = 0, max = 0, n;
+    int w;
+
+    while(readcmd(line)){
+	n = strlen(line);
+	if(n - 1 == (size_t)delim->len && strncmp(line, delim->text, delim->len) == 0){
+	    break;
+	}
+	if(len + n > max){
+	    max = 2 * (len + n);
+	    if((body = realloc(body, max)) == NULL){
+		app_error("out of memory");
+	    }
+	}
+	memcpy(body + len, line, n);
+	len += n;
+    }
+    w = addword(prog, body != NULL ? body : "", len, delim->quoted);
+    free(body);
+    return w;
+}
+
+/*
+ * heredoc - Return a descriptor the text of word w (a here-document or
+ *    here-string) can be read from, or -1. Text that fits in a pipe's
+ *    atomic write goes through a pipe. Anything bigger goes into a
+ *    memfd, sealed so the command gets exactly what was written, and
+ *    never touches the file system.
+ */
+int heredoc(struct prog_t *prog, struct word_t *w)
+{
+    char *text = prog->str + w->str, *buf = NULL, *bp;
+    size_t len = strlen(text), off, size;
+    ssize_t n;
+    int fds[2], fd;
+
+    //grow the buffer until the expanded text fits
+    if(!w->quoted && strchr(text, '$') != NULL){
+	for(size = 2 * len + 64; ; size *= 2){
+	    free(buf);
+	    if((buf = malloc(size)) == NULL){
+		return -1;
+	    }
+	    bp = buf;
+	    if((text = expand(prog, w, &bp, buf + size)) != NULL){
+		break;
+	    }
+	}
+	len = strlen(text);
+    }
+
+    if(len <= PIPE_BUF){
+	if(pipe2(fds, O_CLOEXEC) == -1){
+	    free(buf);
+	    return -1;
+	}
+	if(len > 0 && write(fds[1], text, len) != (ssize_t)len){
+	    close(fds[0]);
+	    fds[0] = -1;
+	}
+	close(fds[1]);
+	free(buf);
+	return fds[0];
+    }
+
+    if((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1){
+	free(buf);
+	return -1;
+    }
+    for(off = 0; off < len; off += n){
+	if((n = write(fd, text + off, len - off)) <= 0){
+	    break;
+	}
+    }
+    free(buf);
+    if(off < len || lseek(fd, 0, SEEK_SET) == -1 ||
+       fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1){
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/*
+ * expand - Return the text of word w with $? replaced by the last exit
+ *    status, and $name or ${name} by the value of the shell or
+ *    environment variable (nothing if it is unset). Expanded words are
+ *    built at *bufp (which is advanced); others point into the pool.
+ *    NULL if the buffer ran out.
+ */
+char *expand(struct prog_t *prog, struct word_t *w, char **bufp, char *end)
+{
+    char *text = prog->str + w->str;
+    char *out = *bufp, *p, *val, num[16];
+    int len, skip;
+
+    if(w->quoted || strchr(text, '$') == NULL){
+	return text;
+    }
+    for(p = out; *text; text += skip){
+	if(text[0] == '$' && text[1] == '?'){
+	    len = snprintf(num, sizeof(num), "%d", exitstatus);
+	    val = num;
+	    skip = 2;
+	} else if(text[0] == '$' && text[1] == '{' && (len = namelen(text + 2)) > 0 && text[2 + len] == '}'){
+	    val = getvar(text + 2, len);
+	    skip = len + 3;
+	    len = val != NULL ? strlen(val) : 0;
+	} else if(text[0] == '$' && (len = namelen(text + 1)) > 0){
+	    val = getvar(text + 1, len);
+	    skip = len + 1;
+	    len = val != NULL ? strlen(val) : 0;
+	} else {
+	    val = text;
+	    len = skip = 1;
+	}
+	if(p + len >= end){
+	    return NULL;
+	}
+	memcpy(p, val, len);
+	p += len;
+    }
+    *p++ = '\0';
+    *bufp = p;
+    return out;
+}
+
+/* namelen - Length of the variable name at the start of s, 0 if none */
+int namelen(char *s)
+{
+    int len = 0;
+
+    if(!isalpha((unsigned char)s[0]) && s[0] != '_'){
+	return 0;
+    }
+    while(isalnum((unsigned char)s[len]) || s[len] == '_'){
+	len++;
+    }
+    return len;
+}
+
+/* getvar - Value of the shell variable, or else the environment variable,
+ *    whose name is the len bytes at name. NULL if there is neither. */
+char *getvar(char *name, int len)
+{
+    char buf[MAXLINE];
+    int i;
+
+    for(i = 0; i < nvars; i++){
+	if(strncmp(vars[i].name, name, len) == 0 && vars[i].name[len] == '\0'){
+	    return vars[i].value;
+	}
+    }
+    snprintf(buf, sizeof(buf), "%.*s", len, name);
+    return getenv(buf);
+}
+
+/* setvar - Set the shell variable named by the len bytes at name to
+ *    value. -1 (with a message) if there is no room for another one. */
+int setvar(char *name, int len, char *value)
+{
+    size_t size = strlen(value) + 1;
+    struct var_t *v;
+    int i;
+
+    for(i = 0; i < nvars; i++){
+	if(strncmp(vars[i].name, name, len) == 0 && vars[i].name[len] == '\0'){
+	    break;
+	}
+    }
+    if(i == MAXVARS){
+	printf("Too many variables\n");
+	return -1;
+    }
+    v = &vars[i];
+    if(i == nvars){
+	if((v->name = strndup(name, len)) == NULL){
+	    app_error("out of memory");
+	}
+	nvars++;
+    }
+    //keep the buffer from pass to pass of a loop
+    if(v->size < size){
+	if((v->value = realloc(v->value, size)) == NULL){
+	    app_error("out of memory");
+	}
+	v->size = size;
+    }
+    memcpy(v->value, value, size);
+    return 0;
+}
+
+/* progreset - Empty prog, keeping its memory */
+void progreset(struct prog_t *prog)
+{
+    prog->nnode = prog->nword = prog->nstr = 0;
+}
+
+/* addnode - Append a zeroed node to prog and return its index */
+int addnode(struct prog_t *prog)
+{
+    if(prog->nnode == prog->maxnode){
+	prog->maxnode = prog->maxnode ? 2 * prog->maxnode : 16;
+	if((prog->node = realloc(prog->node, prog->maxnode * sizeof(struct node_t))) == NULL){
+	    app_error("out of memory");
+	}
+    }
+    memset(&prog->node[prog->nnode], 0, sizeof(struct node_t));
+    prog->node[prog->nnode].in = -1;
+    prog->node[prog->nnode].fan = -1;
+    prog->node[prog->nnode].cond = -1;
+    prog->node[prog->nnode].body = -1;
+    prog->node[prog->nnode].elsep = -1;
+    prog->node[prog->nnode].next = -1;
+    return prog->nnode++;
+}
+
+/* addword - Append a word to prog and return its index */
+int addword(struct prog_t *prog, char *text, int len, int quoted)
+{
+    if(prog->nword == prog->maxword){
+	prog->maxword = prog->maxword ? 2 * prog->maxword : 64;
+	if((prog->word = realloc(prog->word, prog->maxword * sizeof(struct word_t))) == NULL){
+	    app_error("out of memory");
+	}
+    }
+    prog->word[prog->nword].str = addstr(prog, text, len);
+    prog->word[prog->nword].quoted = quoted;
+    return prog->nword++;
+}
+
+/* addstr - Copy len bytes of text into prog's pool, NUL terminated, and
+ *    return their offset */
+int addstr(struct prog_t *prog, char *text, int len)
+{
+    int off = prog->nstr;
+
+    while(prog->nstr + len + 1 > prog->maxstr){
+	prog->maxstr = prog->maxstr ? 2 * prog->maxstr : 1024;
+	if((prog->str = realloc(prog->str, prog->maxstr)) == NULL){
+	    app_error("out of memory");
+	}
+    }
+    memcpy(prog->str + off, text, len);
+    prog->str[off + len] = '\0';
+    prog->nstr += len + 1;
+    return off;
+}
+
+/*
+ * readcmd - Read the next command line from the -c string, the script
+ *    or stdin into cmdline, making sure it ends with a '\n'. Return 0
+ *    at end of input.
+ */
+int readcmd(char *cmdline)
+{
+    size_t len;
+
+    if (cstring != NULL) {
+	len = strcspn(cstring, "\n");
+	if (len == 0 && *cstring == '\0') {
+	    return 0;
+	}
+	if (len > MAXLINE - 2) {
+	    app_error("command line too long");
+	}
+	memcpy(cmdline, cstring, len);
+	cmdline[len] = '\0';
+	cstring += len;
+	if (*cstring == '\n') {
+	    cstring++;
+	}
+    }
+    else {
+	if ((fgets(cmdline, MAXLINE - 1, infile) == NULL)) {
+	    if (ferror(infile)) {
+		app_error("fgets error");
+	    }
+	    return 0;
+	}
+	len = strlen(cmdline);
+	if (cmdline[len-1] == '\n') {
+	    return 1;
+	}
+    }
+    strcat(cmdline, "\n");
+    return 1;
+}
+
+/*
+ * atend - Return true if no command lines are left after the one
+ *    just read
+ */
+int atend(void)
+{
+    int c;
+
+    if (cstring != NULL) {
+	return cstring[strspn(cstring, " \n")] == '\0';
+    }
+    if ((c = getc(infile)) == EOF) {
+	return 1;
+    }
+    ungetc(c, infile);
+    return 0;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.  
  */
 int builtin_cmd(char **argv) 
 {
-    if(strcmp(argv[0], "quit") == 0) {
+    int len;
+
+    if(strcmp(argv[0], ":") == 0 || strcmp(argv[0], "true") == 0) {
+	return 1;
+    } else if(strcmp(argv[0], "false") == 0) {
+	exitstatus = 1;
+	return 1;
+    } else if((len = namelen(argv[0])) > 0 && argv[0][len] == '=' && argv[1] == NULL) {
+	//name=value sets a shell variable
+	if(setvar(argv[0], len, argv[0] + len + 1) < 0) {
+	    exitstatus = 1;
+	}
+	return 1;
+    } else if(strcmp(argv[0], "break") == 0 || strcmp(argv[0], "continue") == 0) {
+	if(looplevel == 0) {
+	    printf("%s: only meaningful in a loop\n", argv[0]);
+	} else {
+	    loopctl = argv[0][0] == 'b' ? LOOP_BREAK : LOOP_CONT;
+	}
+	return 1;
+    } else if(strcmp(argv[0], "quit") == 0) {
 	exit(0);
     } else if(strcmp(argv[0], "jobs") == 0) {
-	listjobs(jobs);
+	if(argv[1] != NULL && strcmp(argv[1], "--json") == 0) {
+	    listjobs_json(jobs);
+	} else {
+	    listjobs(jobs);
+	}
 	return 1;
     } else if((strcmp(argv[0], "bg") == 0) || (strcmp(argv[0], "fg") == 0 )) {
 	do_bgfg(argv);
 	return 1;
+    } else if(strcmp(argv[0], "logs") == 0) {
+	do_logs(argv);
+	return 1;
+    } else if(strcmp(argv[0], "trace") == 0) {
+	//dump the event trace, to the default file unless given one
+	char *path = argv[1] != NULL ? argv[1] : tracepath;
+	if(dumptrace(path) < 0) {
+	    printf("trace: %s: %s\n", path, strerror(errno));
+	    exitstatus = 1;
+	} else {
+	    printf("trace written to %s\n", path);
+	}
+	return 1;
     }
     return 0;     /* not a builtin command */
 }
@@ -354,9 +1899,11 @@ void do_bgfg(char **argv)
     if(argv[1] == NULL) {
 	if(strcmp(argv[0], "bg") == 0) {
 	   printf("bg command requires PID or %%jobid argument\n");
+	   exitstatus = 1;
 	}
 	else {
 	   printf("fg command requires PID or %%jobid argument\n");
+	   exitstatus = 1;
 	}
 	return;
     }
@@ -367,6 +1914,7 @@ void do_bgfg(char **argv)
     //Declare the pid and the job
     pid_t pid;
     struct job_t *job;
+    struct cap_t *cap;
 
     
     if(strcmp(argv[0], "bg") == 0) { //Background process
@@ -380,18 +1928,30 @@ void do_bgfg(char **argv)
  	   //If the PID didn't match any job we print the error message to the user
            if(job == NULL) {
               printf("(%s): No such process\n", argv[1]);
+              exitstatus = 1;
               return;
            }
 	   //If the job exists
 	   
 	   //retrieve the job pid	
 	   pid = job->pid;
+	   if(job->state == RS) {
+	       printf("[%d] (%d) is waiting to respawn\n", job->jid, job->pid);
+	       exitstatus = 1;
+	       return;
+	   }
 
 	   //Resume by sending the SIGCONT signal to the process through kill
 	   kill(-pid, SIGCONT);
 
 	   //Change the job state to BG and print it to the user
 	   job->state = BG;
+	   publishjobs(jobs);
+	   traceev(EV_CONT, pid, job->jid, BG);
+	   if(job->tmrleft > 0) { //the deadline runs again
+	       tmr_add(&job->tmr, job->tmrleft);
+	       job->tmrleft = 0;
+	   }
 	   printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 	   
 	}   
@@ -403,17 +1963,29 @@ void do_bgfg(char **argv)
 	   //If the job ID didn't match any job we print the error message to the user
 	   if(job == NULL) {
               printf("(%c): No such job\n", args[1]);
+              exitstatus = 1;
               return;
            }
 
 	    //retrieve the pid from the job
 	   pid = job->pid;
+	   if(job->state == RS) {
+	       printf("[%d] (%d) is waiting to respawn\n", job->jid, job->pid);
+	       exitstatus = 1;
+	       return;
+	   }
 
 	   //resume the process by sending the SIGCONT signal to the process
 	   kill(-pid, SIGCONT);
 	   
            //Set the process to the background
 	   job->state = BG;
+	   publishjobs(jobs);
+	   traceev(EV_CONT, pid, job->jid, BG);
+	   if(job->tmrleft > 0) { //the deadline runs again
+	       tmr_add(&job->tmr, job->tmrleft);
+	       job->tmrleft = 0;
+	   }
 
 	   //print out the message to the user
 	   printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);	
@@ -421,6 +1993,7 @@ void do_bgfg(char **argv)
 	//If the first argument was neither a digit or % we ask for a proper argument
 	else {
 	    printf("argument must be PID or %%jobid\n");
+	    exitstatus = 1;
 	    return;
 	}
 	
@@ -432,18 +2005,35 @@ void do_bgfg(char **argv)
 	  job = getjobpid(jobs, atoi(argv[1]));  
 	  if(job == NULL) {
 	     printf("(%s): No such process\n", argv[1]);
+	     exitstatus = 1;
 	     return;
 	  }
 	  //retrive the pid from the job
 	  pid = job->pid;
+	  if(job->state == RS) {
+	      printf("[%d] (%d) is waiting to respawn\n", job->jid, job->pid);
+	      exitstatus = 1;
+	      return;
+	  }
 	 
-	  //Resume the process by sending the SIGCONT signal to the process through kill
+	  //Give it the terminal first, so that it finds it there when it
+	  //wakes up. Then resume the process by sending the SIGCONT signal
+	  giveterm(pid);
 	  kill(-pid, SIGCONT);
 
 	  //Change the state of the job to FG and wait until it's no longer 
 	  //a foreground process
 	  job->state = FG;
-	  waitfg(pid); 
+	  publishjobs(jobs);
+	  traceev(EV_CONT, pid, job->jid, FG);
+	  if(job->tmrleft > 0) { //the deadline runs again
+	      tmr_add(&job->tmr, job->tmrleft);
+	      job->tmrleft = 0;
+	  }
+	  cap = getcap(job);
+	  capfollow(cap, 0, 1);
+	  waitfg(pid);
+	  capfollow(cap, 0, 0); //stopped again or gone, buffer what follows 
 	}
 
 	//if it's not it's % (job ID)
@@ -454,53 +2044,174 @@ void do_bgfg(char **argv)
 	  //If the job ID didn't match any job we print the error message to the user
 	  if(job == NULL) {
 	     printf("(%c): No such job\n", args[1]);
+	     exitstatus = 1;
              return;
 	  }
 	  //retrieve the pid from the job
 	  pid = job->pid;
+	  if(job->state == RS) {
+	      printf("[%d] (%d) is waiting to respawn\n", job->jid, job->pid);
+	      exitstatus = 1;
+	      return;
+	  }
 
-	  //resume the process by sending the SIGCONT signal to the process
+	  //resume the process by sending the SIGCONT signal to the process,
+	  //once it has the terminal
+	  giveterm(pid);
           kill(-pid, SIGCONT);
 
 	  //Bring the process to the foreground
           job->state = FG;
+          publishjobs(jobs);
+          traceev(EV_CONT, pid, job->jid, FG);
+          if(job->tmrleft > 0) { //the deadline runs again
+              tmr_add(&job->tmr, job->tmrleft);
+              job->tmrleft = 0;
+          }
 	
 	  //Wait while the job is still in the foreground
+	  cap = getcap(job);
+	  capfollow(cap, 0, 1);
 	  waitfg(pid);
+	  capfollow(cap, 0, 0); //stopped again or gone, buffer what follows
 	}
 
 	//If the first argument was neither a digit or % we ask for a proper argument
 	else {
 	    printf("argument must be PID or %%jobid\n");
+	    exitstatus = 1;
 	}
     }
 
     return;
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * do_logs - Execute the builtin logs command: print what a captured
+ *    background job has written, and with -f keep copying its output
+ *    until it finishes or the user types ctrl-c.
  */
-void waitfg(pid_t pid)
+void do_logs(char **argv) 
 {
-    //Get the job corresponding to the pid. 
-    struct job_t *job = getjobpid(jobs, pid);
-
-    //As long as the job is still a forground job were going to wait.
-    while(job->state == FG){	
-	sleep(1);
-    }	
-    return;
-}
-
-/*****************
- * Signal handlers
- *****************/
+    struct job_t *job;
+    struct cap_t *cap;
+    sigset_t mask, prev;
+    int follow = 0, i;
+    char *arg = NULL;
+
+    for(i = 1; argv[i] != NULL; i++) {
+	if(strcmp(argv[i], "-f") == 0) {
+	    follow = 1;
+	} else {
+	    arg = argv[i];
+	}
+    }
+    if(arg == NULL) {
+	printf("logs command requires PID or %%jobid argument\n");
+	exitstatus = 1;
+	return;
+    }
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+    //find the job the same way bg and fg do; the output of a job
+    //that has finished is kept until its slot is needed again
+    if(isdigit(arg[0])) {
+	if((job = getjobpid(jobs, atoi(arg))) == NULL) {
+	    if((cap = getoldcap(atoi(arg), 0)) != NULL) {
+		fflush(stdout);
+		capfollow(cap, 1, 0);
+		return;
+	    }
+	    printf("(%s): No such process\n", arg);
+	    exitstatus = 1;
+	    return;
+	}
+    } else if(arg[0] == '%') {
+	if((job = getjobjid(jobs, atoi(&arg[1]))) == NULL) {
+	    if((cap = getoldcap(0, atoi(&arg[1]))) != NULL) {
+		fflush(stdout);
+		capfollow(cap, 1, 0);
+		return;
+	    }
+	    printf("%s: No such job\n", arg);
+	    exitstatus = 1;
+	    return;
+	}
+    } else {
+	printf("logs: argument must be a PID or %%jobid\n");
+	exitstatus = 1;
+	return;
+    }
+    if((cap = getcap(job)) == NULL) {
+	printf("logs: output of job [%d] is not captured (see tsh -o)\n", job->jid);
+	exitstatus = 1;
+	return;
+    }
+
+    fflush(stdout);
+    capfollow(cap, 1, follow);
+    if(!follow) {
+	return;
+    }
+
+    //wait for the job to end, or for ctrl-c
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    interrupted = 0;
+    while(!interrupted && capjob(cap) != NULL) {
+	sigsuspend(&prev);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    capfollow(cap, 0, 0);
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid)
+{
+    sigset_t mask, prev;
+    struct job_t *job;
+
+    //Block SIGCHLD while we test the job state and let sigsuspend
+    //unblock it atomically, so a child that finishes between the
+    //test and the wait can't be missed.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    //With a terminal the job owns it while it runs (see giveterm),
+    //and the kernel sends it ctrl-c and ctrl-z itself. Otherwise our
+    //handlers pass them on.
+    //As long as the job is still a forground job were going to wait.
+    while(fgpid(jobs) == pid){
+	sigsuspend(&prev);
+    }
+
+    //take the terminal back, keeping the modes of a stopped job
+    if(ttyfd != -1){
+	tcsetpgrp(ttyfd, shellpgid);
+	if((job = getjobpid(jobs, pid)) != NULL){
+	    job->hastmodes = tcgetattr(ttyfd, &job->tmodes) == 0;
+	}
+	tcsetattr(ttyfd, TCSADRAIN, &shelltmodes);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    //the handler noted how it ended (or stopped)
+    exitstatus = fgstatus;
+    return;
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
  *     available zombie children, but doesn't wait for any other
  *     currently running children to terminate.  
  */
@@ -509,26 +2220,87 @@ void sigchld_handler(int sig)
 	int status;	//The status of the job
 	pid_t pid; 	//the child's pid
 	struct job_t *job;
+	struct rusage ru; //resources used by the child so far
 
 	/*this while loops reaps the child processes one by one. The WNOHANG option makes waitpid return
  	immediatly instead of waiting for the child. The WUNTRACED option requests a status information
 	from stopped processes so that the parent does not wait for them*/
-	while((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0){
+	while((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0){
+	     if(WIFSTOPPED(status)){
+		traceev(EV_STOP, pid, pid2jid(pid), WSTOPSIG(status));
+	     } else {
+		traceev(EV_REAP, pid, pid2jid(pid), status);
+	     }
+	     //a fan-out job stops once and ends with the last of its
+	     //processes, with the status of its last consumer
+	     job = getjobmember(jobs, pid);
+	     if(job != NULL && job->nmembers > 0){
+		if(WIFSTOPPED(status)){
+		    if(job->state == ST){
+			continue;
+		    }
+		} else {
+		    if(pid == job->members[job->nmembers - 1]){
+			job->laststatus = status;
+		    }
+		    if(--job->alive > 0){
+			continue;
+		    }
+		    status = job->laststatus;
+		}
+		pid = job->pid;
+	     }
+	     //the status of a foreground job becomes $?, the shell's way:
+	     //128+signal when killed or stopped, 124 when timed out
+	     job = getjobpid(jobs, pid);
+	     if(job != NULL && job->state == FG){
+		if(WIFEXITED(status)){
+		    fgstatus = WEXITSTATUS(status);
+		} else if(WIFSIGNALED(status)){
+		    fgstatus = 128 + WTERMSIG(status);
+		    //ctrl-c that went straight to the job ends loops too
+		    if(WTERMSIG(status) == SIGINT){
+			interrupted = 1;
+		    }
+		} else {
+		    fgstatus = 128 + WSTOPSIG(status);
+		}
+		if(job->timedout && !(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)){
+		    fgstatus = 124;
+		}
+	     }
 	     if(WIFEXITED(status)){	//if the child is terminated
-	     	deletejob(jobs, pid);
+		//a respawn job is relaunched (or scheduled to be) right here
+		job = getjobpid(jobs, pid);
+		if(job == NULL || !respawnjob(job)){
+		    deletejob(jobs, pid);
+		}
 	     }
 	     //If the child is terminated by signal we print the error message and check 
 	     //which signal caused the child to terminate with WTERMSIG. Last we delete the job
 	     if (WIFSIGNALED(status)) { 
 		job = getjobpid(jobs, pid);
 		printf("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status)); 
-       	        deletejob(jobs,pid);
+		if(!respawnjob(job)){
+		    deletejob(jobs,pid);
+		}
 	     }
 	     //Check if the child has stopped and then check the number of the signal with WSTOPSIG.
 	     //We then print the error message to the user and change the state of the job to ST.
 	     else if(WIFSTOPPED(status)){
 		job = getjobpid(jobs, pid);
 		job->state = ST;
+		//stopped time doesn't count against the deadline
+		if(job->tmr.next != NULL){
+		    job->tmrleft = (long long)(job->tmr.expires - nowtick());
+		    if(job->tmrleft < 1){
+			job->tmrleft = 1;
+		    }
+		    tmr_del(&job->tmr);
+		}
+		job->cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL
+		    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+		publishjobs(jobs);
 		printf("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));	
 	     } 
 	}	
@@ -538,16 +2310,22 @@ void sigchld_handler(int sig)
 /* 
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ *    to the foreground job.  On a terminal we control, the job gets
+ *    ctrl-c straight from the kernel and this only relays signals
+ *    sent to the shell itself.
  */
 void sigint_handler(int sig) 
 {
     //Retrieve the pid of the foreground job
     pid_t pid = fgpid(jobs);
 
+    //let a logs -f that is waiting know it should stop
+    interrupted = 1;
+
     //kill the foreground job if one exists by sending the signal to the 
     //process through kill. 
     if(pid != 0) {
+	traceev(EV_SIGNAL, pid, pid2jid(pid), sig);
 	kill(-pid, sig);
     }
  
@@ -557,7 +2335,8 @@ void sigint_handler(int sig)
 /*
  * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
  *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ *     foreground job by sending it a SIGTSTP.  Like sigint_handler,
+ *     this is the fallback for when there is no terminal to hand over.
  */
 void sigtstp_handler(int sig) 
 {
@@ -567,12 +2346,39 @@ void sigtstp_handler(int sig)
     //if a foreground exists, i stop it by sending the signal to the process
     //through kill.
     if(pid != 0) {
+	traceev(EV_SIGNAL, pid, pid2jid(pid), sig);
 	kill(-pid, sig);
     }
         
     return;
 }
 
+/*
+ * sigusr1_handler - Dump the event trace to tracepath. Everything
+ *    dumptrace does is async-signal-safe.
+ */
+void sigusr1_handler(int sig) 
+{
+    int olderrno = errno;
+
+    dumptrace(tracepath);
+    errno = olderrno;
+    return;
+}
+
+/*
+ * sigalrm_handler - The wheel's kernel timer went off. Fire every
+ *    deadline that has passed and rearm the timer for the next one.
+ */
+void sigalrm_handler(int sig) 
+{
+    int olderrno = errno;
+
+    tmr_run();
+    errno = olderrno;
+    return;
+}
+
 /*********************
  * End signal handlers
  *********************/
@@ -586,6 +2392,25 @@ void clearjob(struct job_t *job) {
     job->pid = 0;
     job->jid = 0;
     job->state = UNDEF;
+    job->start = 0;
+    job->cpu = 0;
+    if (job->tmr.next != NULL) {
+	tmr_del(&job->tmr);
+    }
+    job->tmrleft = 0;
+    job->killafter = 0;
+    job->timedout = 0;
+    if (job->respawn && job->capwr >= 0) {
+	close(job->capwr);
+    }
+    job->respawn = 0;
+    job->restarts = 0;
+    job->crashes = 0;
+    job->downtime = 0;
+    job->hastmodes = 0;
+    job->cap = -1;
+    job->nmembers = 0;
+    job->alive = 0;
     job->cmdline[0] = '\0';
 }
 
@@ -627,7 +2452,11 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
 	    if (nextjid > MAXJOBS) {
 		nextjid = 1;
 	    }
+	    jobs[i].start = nowns();
+	    jobs[i].cpu = 0;
 	    strcpy(jobs[i].cmdline, cmdline);
+	    publishjobs(jobs);
+	    traceev(EV_ADDJOB, pid, jobs[i].jid, state);
 	    if (verbose){
 		printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
             }
@@ -651,6 +2480,7 @@ int deletejob(struct job_t *jobs, pid_t pid)
 	if (jobs[i].pid == pid) {
 	    clearjob(&jobs[i]);
 	    nextjid = maxjid(jobs)+1;
+	    publishjobs(jobs);
 	    return 1;
 	}
     }
@@ -700,6 +2530,23 @@ struct job_t *getjobjid(struct job_t *jobs, int jid)
     return NULL;
 }
 
+/* getjobmember - Find the job a PID belongs to, as its leader or as a
+ *    member of a fan-out */
+struct job_t *getjobmember(struct job_t *jobs, pid_t pid) {
+    int i, j;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == pid)
+	    return &jobs[i];
+	for (j = 0; j < jobs[i].nmembers; j++)
+	    if (jobs[i].members[j] == pid)
+		return &jobs[i];
+    }
+    return NULL;
+}
+
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) 
 {
@@ -734,35 +2581,1397 @@ void listjobs(struct job_t *jobs)
 	    case ST: 
 		printf("Stopped ");
 		break;
+	    case RS: 
+		printf("Respawning ");
+		break;
 	    default:
 		printf("listjobs: Internal error: job[%d].state=%d ", 
 		       i, jobs[i].state);
 	    }
+	    if (jobs[i].respawn) {
+		printf("(restarts %d, down %.3fs) ", jobs[i].restarts,
+		       jobdowntime(&jobs[i]) / 1e9);
+	    }
 	    printf("%s", jobs[i].cmdline);
 	}
     }
 }
+/* listjobs_json - Print the job list as a JSON array */
+void listjobs_json(struct job_t *jobs) 
+{
+    static const char *statename[] = { "Undefined", "Foreground", "Running", "Stopped",
+				       "Respawning" };
+    int i, first = 1;
+    char *p;
+
+    printf("[");
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid != 0) {
+	    printf("%s\n  {\"jid\": %d, \"pid\": %d, \"state\": \"%s\", "
+		   "\"start_ns\": %lld, \"cpu_us\": %lld, ",
+		   first ? "" : ",", jobs[i].jid, jobs[i].pid,
+		   statename[jobs[i].state], jobs[i].start, jobcpu(&jobs[i]));
+	    if (jobs[i].respawn) {
+		printf("\"restarts\": %d, \"down_ns\": %lld, ", jobs[i].restarts,
+		       jobdowntime(&jobs[i]));
+	    }
+	    printf("\"cmdline\": \"");
+	    for (p = jobs[i].cmdline; *p && *p != '\n'; p++) {
+		if (*p == '"' || *p == '\\') {
+		    printf("\\%c", *p);
+		} else if ((unsigned char)*p < ' ') {
+		    printf("\\u%04x", *p);
+		} else {
+		    putchar(*p);
+		}
+	    }
+	    printf("\"}");
+	    first = 0;
+	}
+    }
+    printf("%s]\n", first ? "" : "\n");
+}
+
+/*
+ * openstatus - Create the shared job status page in the file path
+ *    (see tshfmt.h) and publish the empty job list. The page is built
+ *    under a temporary name and renamed into place, so a monitor never
+ *    maps a file that is still short, or one being reused.
+ */
+void openstatus(char *path) 
+{
+    char tmp[MAXLINE + 16];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644)) < 0) {
+	unix_error(tmp);
+    }
+    if (ftruncate(fd, sizeof(struct tshstat)) < 0) {
+	unlink(tmp);
+	unix_error("ftruncate error");
+    }
+    statpage = mmap(NULL, sizeof(struct tshstat), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+    if (statpage == MAP_FAILED) {
+	unlink(tmp);
+	unix_error("mmap error");
+    }
+    close(fd);
+    statpage->version = TSHSTAT_VERSION;
+    statpage->shellpid = getpid();
+    publishjobs(jobs);
+    __atomic_store_n(&statpage->magic, TSHSTAT_MAGIC, __ATOMIC_RELEASE);
+    if (rename(tmp, path) < 0) {
+	unlink(tmp);
+	unix_error(path);
+    }
+}
+
+/*
+ * publishjobs - Copy the job list to the status page, if there is
+ *    one. Called after every job state transition, from the handlers
+ *    as well as from the main routine, so signals are blocked while
+ *    the sequence lock is held.
+ */
+void publishjobs(struct job_t *jobs) 
+{
+    struct tshstat_job *sj;
+    sigset_t mask, prev;
+    uint32_t seq;
+    int i;
+
+    if (statpage == NULL) {
+	return;
+    }
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    seq = statpage->seq;
+    __atomic_store_n(&statpage->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < MAXJOBS; i++) {
+	sj = &statpage->job[i];
+	sj->pid = jobs[i].pid;
+	sj->jid = jobs[i].jid;
+	sj->state = jobs[i].state;
+	sj->start = jobs[i].start;
+	sj->cpu = jobcpu(&jobs[i]);
+	strcpy(sj->cmdline, jobs[i].cmdline);
+    }
+    statpage->updated = nowns();
+    __atomic_store_n(&statpage->seq, seq + 2, __ATOMIC_RELEASE);
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * jobcpu - CPU time (user+sys) of job in us: sampled from the clock
+ *    of its process while it runs, else as of its last stop
+ */
+long long jobcpu(struct job_t *job) 
+{
+    struct timespec ts;
+    clockid_t clk;
+
+    if ((job->state != FG && job->state != BG) ||
+	clock_getcpuclockid(job->pid, &clk) != 0 ||
+	clock_gettime(clk, &ts) != 0) {
+	return job->cpu;
+    }
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * needshell - Does a job still need the shell to stay around: for a
+ *    deadline, to be respawned, or to have its output captured?
+ */
+int needshell(void) 
+{
+    int i;
+
+    if (ntimers > 0) {
+	return 1;
+    }
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid != 0 && (jobs[i].respawn || jobs[i].cap >= 0)) {
+	    return 1;
+	}
+	if (caps[i].pid != 0 && caps[i].fd >= 0) {
+	    return 1;
+	}
+    }
+    return 0;
+}
 /******************************
  * end job list helper routines
  ******************************/
 
 
+/***************************************************
+ * Timer wheel routines, for the timeout builtin.
+ *
+ * Deadlines live on a hierarchical timing wheel: an entry due within
+ * 64 ticks sits in the level 0 slot of its tick, later ones in the
+ * coarser levels, and every time a level wraps the next slot up is
+ * cascaded down a level. A single POSIX timer is armed for the next
+ * tick that has anything to do, so adding, cancelling and firing a
+ * deadline is O(1) however many are pending. The wheel is shared by
+ * the main routine and the handlers, so every entry point blocks all
+ * signals while it changes it.
+ ***************************************************/
+
+/* nowtick - The current CLOCK_MONOTONIC time in ticks */
+unsigned long long nowtick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec) / TICK_NS;
+}
+
+/* tmr_link - Queue t in the slot for t->expires; signals blocked */
+void tmr_link(struct tmr_t *t)
+{
+    unsigned long long delta = t->expires - wheelnow;
+    struct tmr_t *head;
+    int lvl;
+
+    for (lvl = 0; lvl < WHEELLVLS - 1; lvl++) {
+	if (delta < (1ULL << (WHEELBITS * (lvl + 1)))) {
+	    break;
+	}
+    }
+    if (lvl == WHEELLVLS - 1 &&
+	delta >= (1ULL << (WHEELBITS * WHEELLVLS))) { /* clamp to ~46h */
+	t->expires = wheelnow + (1ULL << (WHEELBITS * WHEELLVLS)) - 1;
+    }
+    head = &wheel[lvl][(t->expires >> (WHEELBITS * lvl)) & WHEELMASK];
+    if (head->next == NULL) { /* first use of this slot */
+	head->next = head->prev = head;
+    }
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* tmr_add - Queue t to expire ticks from now */
+void tmr_add(struct tmr_t *t, long long ticks)
+{
+    sigset_t mask, prev;
+
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (ntimers == 0) { /* nothing to catch up on */
+	wheelnow = nowtick();
+    }
+    t->expires = nowtick() + (ticks > 0 ? ticks : 1);
+    tmr_link(t);
+    ntimers++;
+    tmr_arm();
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* tmr_del - Take t off the wheel */
+void tmr_del(struct tmr_t *t)
+{
+    sigset_t mask, prev;
+
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (t->next != NULL) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	ntimers--;
+	tmr_arm();
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* tmr_expire - A job's deadline passed: signal its process group */
+void tmr_expire(struct tmr_t *t)
+{
+    struct job_t *job = (struct job_t *)((char *)t - offsetof(struct job_t, tmr));
+
+    if (job->state == RS) { /* respawn backoff is over */
+	if (spawnagain(job) < 0) {
+	    deletejob(jobs, job->pid);
+	}
+	return;
+    }
+    traceev(EV_SIGNAL, job->pid, job->jid, job->tmrsig);
+    kill(-job->pid, job->tmrsig);
+    job->timedout = 1;
+    if (job->killafter > 0) { /* -k: follow up with SIGKILL */
+	job->tmrsig = SIGKILL;
+	t->expires = wheelnow + job->killafter;
+	job->killafter = 0;
+	tmr_link(t);
+	ntimers++;
+    }
+}
+
+/* tmr_run - Advance the wheel to the current tick, firing deadlines */
+void tmr_run(void)
+{
+    unsigned long long now = nowtick();
+    struct tmr_t *head, *t, list;
+    sigset_t mask, prev;
+    int lvl;
+
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    while (ntimers > 0 && wheelnow < now) {
+	wheelnow++;
+
+	/* When a level wraps, spread the next slot of the level above
+	 * over the levels below */
+	for (lvl = 1; lvl < WHEELLVLS; lvl++) {
+	    if ((wheelnow & ((1ULL << (WHEELBITS * lvl)) - 1)) != 0) {
+		break;
+	    }
+	    head = &wheel[lvl][(wheelnow >> (WHEELBITS * lvl)) & WHEELMASK];
+	    if (head->next == NULL || head->next == head) {
+		continue;
+	    }
+	    list.next = head->next; /* detach, then relink one by one */
+	    head->prev->next = &list;
+	    head->next = head->prev = head;
+	    while ((t = list.next) != &list) {
+		list.next = t->next;
+		tmr_link(t);
+	    }
+	}
+
+	/* Fire everything due on this tick */
+	head = &wheel[0][wheelnow & WHEELMASK];
+	while (head->next != NULL && (t = head->next) != head) {
+	    t->prev->next = t->next;
+	    t->next->prev = t->prev;
+	    t->next = t->prev = NULL;
+	    ntimers--;
+	    tmr_expire(t);
+	}
+    }
+    tmr_arm();
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* tmr_arm - Set the kernel timer for the next tick with work to do,
+ *    or disarm it if the wheel is empty; signals blocked */
+void tmr_arm(void)
+{
+    struct itimerspec its;
+    unsigned long long next = 0, tick;
+    struct tmr_t *head;
+    int lvl, k;
+
+    memset(&its, 0, sizeof(its));
+    if (ntimers > 0) {
+	/* The earliest of the next busy level 0 slot and the next
+	 * cascade of a busy slot further up */
+	for (lvl = 0; lvl < WHEELLVLS; lvl++) {
+	    for (k = 1; k <= WHEELSIZE; k++) {
+		tick = ((wheelnow >> (WHEELBITS * lvl)) + k) << (WHEELBITS * lvl);
+		if (next != 0 && tick >= next) {
+		    break;
+		}
+		head = &wheel[lvl][(tick >> (WHEELBITS * lvl)) & WHEELMASK];
+		if (head->next != NULL && head->next != head) {
+		    next = tick;
+		    break;
+		}
+	    }
+	}
+	if (next == 0) { /* can't happen, but don't sleep forever */
+	    next = wheelnow + 1;
+	}
+	its.it_value.tv_sec = next * TICK_NS / 1000000000LL;
+	its.it_value.tv_nsec = next * TICK_NS % 1000000000LL;
+    }
+    timer_settime(wheeltimer, TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * parsetimeout - Parse "timeout DURATION [-s SIG] [-k KILL_AFTER] cmd"
+ *    (the options may also come before DURATION). Durations are in
+ *    seconds, with an optional ms, s, m, h or d suffix. Return the
+ *    index of cmd in argv, or 0 after printing an error.
+ */
+int parsetimeout(char **argv, long long *ticks, int *sig, long long *killafter)
+{
+    static const struct { char *name; int sig; } signames[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+	{ "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+	{ "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "STOP", SIGSTOP },
+	{ "TSTP", SIGTSTP }, { "CONT", SIGCONT }, { NULL, 0 }
+    };
+    long long *dst;
+    char *arg, *end;
+    double val;
+    int i = 1, k, gotdur = 0;
+
+    while (argv[i] != NULL) {
+	arg = argv[i];
+	if (strcmp(arg, "-s") == 0 && argv[i+1] != NULL) {
+	    arg = argv[i+1];
+	    if (strncmp(arg, "SIG", 3) == 0) {
+		arg += 3;
+	    }
+	    *sig = isdigit(arg[0]) ? atoi(arg) : 0;
+	    for (k = 0; signames[k].name != NULL; k++) {
+		if (strcmp(arg, signames[k].name) == 0) {
+		    *sig = signames[k].sig;
+		}
+	    }
+	    if (*sig <= 0 || *sig >= NSIG) {
+		printf("timeout: invalid signal %s\n", argv[i+1]);
+		return 0;
+	    }
+	    i += 2;
+	    continue;
+	}
+	if (gotdur && strcmp(arg, "-k") != 0) {
+	    break;
+	}
+	dst = ticks;
+	if (strcmp(arg, "-k") == 0 && argv[i+1] != NULL) {
+	    dst = killafter;
+	    arg = argv[++i];
+	}
+	val = strtod(arg, &end);
+	if (end == arg || val < 0) {
+	    printf("timeout: invalid duration %s\n", arg);
+	    return 0;
+	}
+	if (strcmp(end, "ms") == 0) {
+	    val /= 1000;
+	} else if (strcmp(end, "m") == 0) {
+	    val *= 60;
+	} else if (strcmp(end, "h") == 0) {
+	    val *= 3600;
+	} else if (strcmp(end, "d") == 0) {
+	    val *= 86400;
+	} else if (*end != '\0' && strcmp(end, "s") != 0) {
+	    printf("timeout: invalid duration %s\n", arg);
+	    return 0;
+	}
+	*dst = (long long)(val * 1e9 / TICK_NS + 0.5);
+	if (*dst == 0 && val > 0) {
+	    *dst = 1;
+	}
+	if (dst == ticks) {
+	    gotdur = 1;
+	}
+	i++;
+    }
+    if (!gotdur || argv[i] == NULL) {
+	printf("usage: timeout DURATION [-s SIG] [-k KILL_AFTER] command\n");
+	return 0;
+    }
+    return i;
+}
+
+/***************************************************
+ * Output capture routines, for tsh -o.
+ *
+ * Each captured background job writes its stdout and stderr into a
+ * pipe of its own. One thread waits on all of the pipes with epoll
+ * and moves whatever arrives into the job's ring buffer. While the job
+ * is followed (fg, logs -f) the bytes also go to stdout, duplicated by
+ * tee(2) inside the kernel when stdout is a pipe.
+ * The handlers never touch the capture slots, so the thread and the
+ * main routine only need caplock between themselves.
+ ***************************************************/
+
+/*
+ * capstart - Start capturing the output that job pid (job ID jid)
+ *    writes into the pipe fd. Called with signals blocked. Returns NULL
+ *    on failure.
+ */
+struct cap_t *capstart(pid_t pid, int jid, int fd)
+{
+    static pthread_t tid;
+    struct epoll_event ev;
+    struct cap_t *cap = NULL;
+    sigset_t all, prev;
+    int i;
+
+    if (capepfd < 0) { /* first captured job: start the thread */
+	if ((capepfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	    printf("epoll_create1: %s\n", strerror(errno));
+	    return NULL;
+	}
+	/* The thread must never run our handlers */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	i = pthread_create(&tid, NULL, capthread, NULL);
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	if (i != 0) {
+	    printf("pthread_create: %s\n", strerror(i));
+	    close(capepfd);
+	    capepfd = -1;
+	    return NULL;
+	}
+    }
+
+    /* Take a slot never used, else one whose pipe is drained and whose
+     * job is gone, preferably one whose output was all shown: logs can
+     * still print the others */
+    pthread_mutex_lock(&caplock);
+    for (i = 0; i < MAXJOBS; i++) {
+	if (caps[i].jid == jid) { /* %jid means the new job from now on */
+	    caps[i].jid = 0;
+	}
+	if (caps[i].pid != 0 && (caps[i].fd >= 0 || capjob(&caps[i]) != NULL)) {
+	    continue;
+	}
+	if (cap == NULL || caps[i].pid == 0 ||
+	    (cap->pid != 0 && caps[i].shown == caps[i].total && cap->shown < cap->total)) {
+	    cap = &caps[i];
+	}
+    }
+    if (cap != NULL && cap->buf == NULL && (cap->buf = malloc(CAPBUF)) == NULL) {
+	cap = NULL;
+    }
+    if (cap != NULL) {
+	cap->pid = pid;
+	cap->jid = jid;
+	cap->fd = fd;
+	cap->follow = 0;
+	cap->total = 0;
+	cap->shown = 0;
+	ev.events = EPOLLIN;
+	ev.data.u32 = cap - caps;
+	if (epoll_ctl(capepfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    cap->fd = -1;
+	    cap = NULL;
+	}
+    }
+    pthread_mutex_unlock(&caplock);
+    if (cap == NULL) {
+	printf("Could not capture output of job (%d)\n", pid);
+    }
+    return cap;
+}
+
+/* getcap - Find the capture slot of job, NULL if it is not captured */
+struct cap_t *getcap(struct job_t *job)
+{
+    return job->cap >= 0 ? &caps[job->cap] : NULL;
+}
+
+/* capjob - Find the job that cap belongs to, NULL if it has finished.
+ *    A respawn job keeps its slot from run to run, under a new pid. */
+struct job_t *capjob(struct cap_t *cap)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid != 0 && jobs[i].cap == cap - caps) {
+	    return &jobs[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ * getoldcap - Find the capture slot of a job that has finished, by its
+ *    pid, or by its jid if pid is 0. NULL if it was never captured or
+ *    its slot has been reused.
+ */
+struct cap_t *getoldcap(pid_t pid, int jid)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (caps[i].pid != 0 && (pid != 0 ? caps[i].pid == pid : caps[i].jid == jid) &&
+	    capjob(&caps[i]) == NULL) {
+	    return &caps[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ * capwrite - Write cap's ring to stdout, from byte from (or the oldest
+ *    one still kept) up to the newest; caplock held
+ */
+void capwrite(struct cap_t *cap, unsigned long long from)
+{
+    size_t off, len;
+
+    if (from + CAPBUF < cap->total) {
+	from = cap->total - CAPBUF;
+    }
+    while (from < cap->total) {
+	off = from % CAPBUF;
+	len = CAPBUF - off;
+	if (len > cap->total - from) {
+	    len = cap->total - from;
+	}
+	if (write(STDOUT_FILENO, cap->buf + off, len) < 0) {
+	    break;
+	}
+	from += len;
+    }
+    if (cap->shown < cap->total) {
+	cap->shown = cap->total;
+    }
+}
+
+/*
+ * capfollow - Print cap's ring (replay set), then either send its live
+ *    output to stdout as well (on) or only buffer it (!on). Turning
+ *    follow on for fg only replays what hasn't been shown yet; turning
+ *    it off first shows what the job wrote before that.
+ */
+void capfollow(struct cap_t *cap, int replay, int on)
+{
+    if (cap == NULL) {
+	return;
+    }
+    pthread_mutex_lock(&caplock);
+    fflush(stdout);
+    if (replay) {
+	capwrite(cap, 0);
+    }
+    else if (on) {
+	capwrite(cap, cap->shown);
+    }
+    else if (cap->follow) {
+	while (cap->fd >= 0 && capread(cap, CAPBUF) > 0)
+	    ;
+	capwrite(cap, cap->shown);
+    }
+    cap->follow = on;
+    pthread_mutex_unlock(&caplock);
+}
+
+/*
+ * capread - Move up to max bytes from cap's pipe into its ring;
+ *    caplock held. Returns what read(2) does.
+ */
+ssize_t capread(struct cap_t *cap, size_t max)
+{
+    size_t off = cap->total % CAPBUF;
+    ssize_t n;
+
+    if (max > CAPBUF - off) { /* the rest wraps on the next call */
+	max = CAPBUF - off;
+    }
+    if ((n = read(cap->fd, cap->buf + off, max)) > 0) {
+	cap->total += n;
+    }
+    return n;
+}
+
+/*
+ * capthread - Drain the capture pipes as data arrives
+ */
+void *capthread(void *arg)
+{
+    struct epoll_event ev[MAXJOBS];
+    struct cap_t *cap;
+    unsigned long long from;
+    ssize_t n, t;
+    int i, nev;
+
+    while (1) {
+	if ((nev = epoll_wait(capepfd, ev, MAXJOBS, -1)) < 0) {
+	    continue;
+	}
+	pthread_mutex_lock(&caplock);
+	for (i = 0; i < nev; i++) {
+	    cap = &caps[ev[i].data.u32];
+	    if (cap->fd < 0) {
+		continue;
+	    }
+	    if (cap->follow &&
+		(t = tee(cap->fd, STDOUT_FILENO, CAPBUF, SPLICE_F_NONBLOCK)) > 0) {
+		/* stdout is a pipe: the kernel duplicated the bytes onto
+		 * it without copying, now keep them in the ring too */
+		for (n = 0; n < t; n += capread(cap, t - n))
+		    ;
+		cap->shown = cap->total;
+		continue;
+	    }
+	    /* Not following, or stdout can't take a tee (a tty, say) */
+	    from = cap->total;
+	    n = capread(cap, CAPBUF);
+	    if (n > 0 && cap->follow) {
+		capwrite(cap, from);
+	    }
+	    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		/* EOF: every process in the job closed its end */
+		epoll_ctl(capepfd, EPOLL_CTL_DEL, cap->fd, NULL);
+		close(cap->fd);
+		cap->fd = -1;
+	    }
+	}
+	pthread_mutex_unlock(&caplock);
+    }
+    return NULL;
+}
+
+/***************************************************
+ * Respawn routines, for the respawn builtin.
+ *
+ * A respawn job that dies in the background is relaunched straight
+ * from sigchld_handler, under the same job ID. A run shorter than
+ * RS_QUICK counts as a crash. Without --backoff the job is relaunched
+ * at once unless it has crashed RS_MAXQUICK times in a row. With
+ * --backoff every crash doubles the delay before the next run, from
+ * RS_DELAY, using the timer wheel, until it would pass RS_MAXDELAY.
+ * A job that dies while in the foreground, or because of a timeout, is
+ * not respawned.
+ ***************************************************/
+
+/*
+ * parserespawn - Parse "respawn [--max N] [--backoff] cmd". Return the
+ *    index of cmd in argv, or 0 after printing an error.
+ */
+int parserespawn(char **argv, int *max, int *backoff)
+{
+    int i = 1;
+
+    while (argv[i] != NULL && strncmp(argv[i], "--", 2) == 0) {
+	if (strcmp(argv[i], "--backoff") == 0) {
+	    *backoff = 1;
+	    i++;
+	} else if (strcmp(argv[i], "--max") == 0 && argv[i+1] != NULL &&
+		   isdigit(argv[i+1][0])) {
+	    *max = atoi(argv[i+1]);
+	    i += 2;
+	} else {
+	    break;
+	}
+    }
+    if (argv[i] == NULL || strncmp(argv[i], "--", 2) == 0) {
+	printf("usage: respawn [--max N] [--backoff] command &\n");
+	return 0;
+    }
+    return i;
+}
+
+/* saveargv - Keep a copy of argv in job for relaunching it */
+void saveargv(struct job_t *job, char **argv)
+{
+    char *p = job->rsbuf;
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++) {
+	strcpy(p, argv[i]);
+	job->rsargv[i] = p;
+	p += strlen(p) + 1;
+    }
+    job->rsargv[i] = NULL;
+}
+
+/* jobdowntime - Total time job has spent dead, in ns */
+long long jobdowntime(struct job_t *job)
+{
+    if (job->state == RS) {
+	return job->downtime + nowns() - job->died;
+    }
+    return job->downtime;
+}
+
+/*
+ * respawnjob - The current run of job has died: relaunch it now, or
+ *    schedule it on the timer wheel. Return 0 if the job should be
+ *    deleted instead. Called from the handlers.
+ */
+int respawnjob(struct job_t *job)
+{
+    long long delay = 0;
+
+    if (!job->respawn || job->state != BG || job->timedout) {
+	return 0;
+    }
+    if (job->maxrestarts > 0 && job->restarts >= job->maxrestarts) {
+	printf("Job [%d] (%d) not respawned, reached --max %d\n",
+	       job->jid, job->pid, job->maxrestarts);
+	return 0;
+    }
+
+    job->died = nowns();
+    if (job->died - job->spawned < RS_QUICK) {
+	job->crashes++;
+    } else {
+	job->crashes = 0;
+    }
+    if (job->backoff && job->crashes > 0) {
+	delay = (long long)RS_DELAY << (job->crashes - 1);
+    }
+    if ((job->backoff && delay > RS_MAXDELAY) ||
+	(!job->backoff && job->crashes >= RS_MAXQUICK)) {
+	printf("Job [%d] (%d) not respawned, crash loop after %d restarts\n",
+	       job->jid, job->pid, job->restarts);
+	return 0;
+    }
+
+    if (delay == 0) {
+	return spawnagain(job) == 0;
+    }
+    job->state = RS;
+    tmr_add(&job->tmr, delay);
+    publishjobs(jobs);
+    return 1;
+}
+
+/*
+ * spawnagain - Fork and exec the next run of respawn job job. Return 0
+ *    on success, -1 if the fork failed. Only async-signal-safe calls
+ *    between fork and exec.
+ */
+int spawnagain(struct job_t *job)
+{
+    sigset_t empty;
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+	return -1;
+    }
+    if (pid == 0) {
+	setpgid(0, 0);
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+	execcmd(job->rsargv, -1, job->capwr);
+    }
+    setpgid(pid, pid); /* so kill(-pid) works before the child gets to it */
+
+    traceev(EV_FORK, pid, job->jid, 0);
+    if (verbose) {
+	printf("Respawned job [%d] (%d) as (%d)\n", job->jid, job->pid, pid);
+    }
+    job->pid = pid;
+    job->state = BG;
+    job->restarts++;
+    job->spawned = nowns();
+    job->downtime += job->spawned - job->died;
+    publishjobs(jobs);
+    traceev(EV_ADDJOB, pid, job->jid, BG);
+    return 0;
+}
+
+/***************************************************
+ * Script cache routines, for tsh <script>.
+ *
+ * A script is parsed as a whole into one prog, its lines linked into
+ * a single list. Since a prog holds no pointers, it is saved as is in
+ * the cache directory ($TSHCACHE, or $XDG_CACHE_HOME/tsh, or
+ * ~/.cache/tsh), in a file named after a hash of the script's full
+ * path. The next run that finds the script's path, mtime and size in
+ * the header maps the file and runs the nodes in place. CACHE_VERSION
+ * must change whenever the node, word or header layout does. A cache
+ * file that isn't ours, or that others may write to, is never run.
+ ***************************************************/
+
+#define CACHE_MAGIC   0x54534843  /* "TSHC" */
+#define CACHE_VERSION 4
+
+struct cachehdr {           /* Header of a cached script */
+    unsigned int magic;     /* CACHE_MAGIC */
+    unsigned int version;   /* CACHE_VERSION */
+    long long mtime;        /* the script's mtime, in ns */
+    long long size;         /* the script's size */
+    int root;               /* first node, -1 if there are none */
+    int nnode;              /* then nnode nodes, nword words and nstr */
+    int nword;              /* bytes of strings follow the header */
+    int nstr;
+    char path[PATH_MAX];    /* the script's full path */
+};
+
+/*
+ * runscript - Compile the script at path, which is open on infile, or
+ *    load it from the cache, and run it. Return 0 without running
+ *    anything if the script has a syntax error.
+ */
+int runscript(char *path)
+{
+    static struct prog_t prog;
+    char full[PATH_MAX];
+    struct stat st;
+    int root;
+
+    if(realpath(path, full) == NULL || fstat(fileno(infile), &st) == -1){
+	return 0;
+    }
+    if((root = loadcache(full, &st, &prog)) == -2){
+	if(verbose){
+	    printf("Compiling %s\n", path);
+	}
+	if((root = compile(&prog)) == -2){
+	    rewind(infile);
+	    return 0;
+	}
+	savecache(full, &st, &prog, root);
+    } else if(verbose){
+	printf("Running %s from the cache\n", path);
+    }
+    //the last command of a script can replace the shell
+    runlist(&prog, root, 1);
+    return 1;
+}
+
+/*
+ * compile - Parse all of infile into prog. Return the first node, -1
+ *    if there are none, or -2 on a syntax error.
+ */
+int compile(struct prog_t *prog)
+{
+    char cmdline[MAXLINE];
+    int root = -1, last = -1, n;
+
+    progreset(prog);
+    while(readcmd(cmdline)){
+	if((n = parseprog(prog, cmdline)) == -2){
+	    return -2;
+	}
+	if(n < 0){
+	    continue;
+	}
+	//join the line's list to the lines before it
+	if(last >= 0){
+	    prog->node[last].next = n;
+	} else {
+	    root = n;
+	}
+	for(last = n; prog->node[last].next >= 0; last = prog->node[last].next)
+	    ;
+    }
+    return root;
+}
+
+/*
+ * loadcache - Map the cached copy of the script at path into prog, if
+ *    there is a valid one for this version of it. Return its first
+ *    node (or -1), or -2 if it has to be compiled again.
+ */
+int loadcache(char *path, struct stat *st, struct prog_t *prog)
+{
+    char file[PATH_MAX];
+    struct cachehdr *hdr;
+    struct stat cst;
+    size_t size;
+    char *map;
+    int fd;
+
+    if(nocache || cachefile(path, file) < 0 || (fd = open(file, O_RDONLY | O_CLOEXEC)) == -1){
+	return -2;
+    }
+    if(fstat(fd, &cst) == -1 || cst.st_size < (off_t)sizeof(struct cachehdr)){
+	close(fd);
+	return -2;
+    }
+    //someone else could have planted it, in a shared $TSHCACHE say
+    if(cst.st_uid != geteuid() || (cst.st_mode & (S_IWGRP | S_IWOTH))){
+	if(verbose){
+	    printf("Ignoring %s: not owned by us or writable by others\n", file);
+	}
+	close(fd);
+	return -2;
+    }
+    size = cst.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+	return -2;
+    }
+
+    //the script must not have changed, and the counts must add up
+    hdr = (struct cachehdr *)map;
+    if(verbose && hdr->magic == CACHE_MAGIC && hdr->version == CACHE_VERSION &&
+       (hdr->mtime != st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec ||
+	hdr->size != st->st_size)){
+	printf("The script has changed since it was cached\n");
+    }
+    if(hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION ||
+       hdr->mtime != st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec ||
+       hdr->size != st->st_size || strncmp(hdr->path, path, PATH_MAX) != 0 ||
+       hdr->nnode < 0 || hdr->nword < 0 || hdr->nstr < 0 ||
+       size != sizeof(struct cachehdr) + (size_t)hdr->nnode * sizeof(struct node_t) +
+               (size_t)hdr->nword * sizeof(struct word_t) + hdr->nstr){
+	munmap(map, size);
+	return -2;
+    }
+    prog->node = (struct node_t *)(map + sizeof(struct cachehdr));
+    prog->nnode = hdr->nnode;
+    prog->word = (struct word_t *)(prog->node + hdr->nnode);
+    prog->nword = hdr->nword;
+    prog->str = (char *)(prog->word + hdr->nword);
+    prog->nstr = hdr->nstr;
+    prog->maxnode = prog->maxword = prog->maxstr = 0;
+    if(!checkprog(prog, hdr->root)){
+	munmap(map, size);
+	memset(prog, 0, sizeof(struct prog_t));
+	return -2;
+    }
+    return hdr->root;
+}
+
+/*
+ * savecache - Write prog out as the cached copy of the script at path.
+ *    It goes to a temporary file first and is renamed into place, so
+ *    a concurrent run never maps half of it. Errors are ignored: the
+ *    script just gets compiled again next time.
+ */
+void savecache(char *path, struct stat *st, struct prog_t *prog, int root)
+{
+    char file[PATH_MAX], tmp[PATH_MAX + 32];
+    struct cachehdr hdr;
+    FILE *fp;
+    int ok, fd;
+
+    if(nocache || cachefile(path, file) < 0){
+	return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_MAGIC;
+    hdr.version = CACHE_VERSION;
+    hdr.mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    hdr.size = st->st_size;
+    hdr.root = root;
+    hdr.nnode = prog->nnode;
+    hdr.nword = prog->nword;
+    hdr.nstr = prog->nstr;
+    strncpy(hdr.path, path, PATH_MAX - 1);
+
+    //a fresh file of our own, not whatever may sit at that name already
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) == -1){
+	return;
+    }
+    if((fp = fdopen(fd, "w")) == NULL){
+	close(fd);
+	unlink(tmp);
+	return;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	 fwrite(prog->node, sizeof(struct node_t), prog->nnode, fp) == (size_t)prog->nnode &&
+	 fwrite(prog->word, sizeof(struct word_t), prog->nword, fp) == (size_t)prog->nword &&
+	 fwrite(prog->str, 1, prog->nstr, fp) == (size_t)prog->nstr;
+    if(fclose(fp) != 0 || !ok || rename(tmp, file) == -1){
+	unlink(tmp);
+    }
+}
+
+/*
+ * cachefile - Put the name of the cache file for the script at path in
+ *    file, creating the cache directory if needed. -1 if there is no
+ *    place for it.
+ */
+int cachefile(char *path, char *file)
+{
+    char dir[PATH_MAX - 32];  /* leaves room for the file name */
+    unsigned long long h = 0xcbf29ce484222325ULL; /* FNV-1a */
+    char *env;
+
+    if((env = getenv("TSHCACHE")) != NULL){
+	snprintf(dir, sizeof(dir), "%s", env);
+    } else if((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0'){
+	snprintf(dir, sizeof(dir), "%s/tsh", env);
+    } else if((env = getenv("HOME")) != NULL){
+	snprintf(dir, sizeof(dir), "%s/.cache", env);
+	mkdir(dir, 0700);
+	snprintf(dir, sizeof(dir), "%s/.cache/tsh", env);
+    } else {
+	return -1;
+    }
+    if(dir[0] == '\0' || (mkdir(dir, 0700) == -1 && errno != EEXIST)){
+	return -1;
+    }
+    for(; *path; path++){
+	h = (h ^ (unsigned char)*path) * 0x100000001b3ULL;
+    }
+    snprintf(file, PATH_MAX, "%s/%016llx.tshc", dir, h);
+    return 0;
+}
+
+/*
+ * checkprog - Check that every index in a loaded prog is in range, so
+ *    that a damaged cache file can't send the shell astray.
+ */
+int checkprog(struct prog_t *prog, int root)
+{
+    struct node_t *np;
+    int i;
+
+    if(root < -1 || root >= prog->nnode ||
+       (prog->nstr > 0 && prog->str[prog->nstr - 1] != '\0')){
+	return 0;
+    }
+    for(i = 0; i < prog->nnode; i++){
+	np = &prog->node[i];
+	//lists only point forward, so they can't loop
+	if(np->type < N_CMD || np->type > N_IF ||
+	   (np->next != -1 && np->next <= i) || np->next >= prog->nnode ||
+	   np->argc < ((np->type == N_CMD || np->type == N_FOR) ? 1 : 0) ||
+	   np->argc >= MAXARGS || np->argv < 0 ||
+	   np->argv + np->argc > prog->nword ||
+	   (np->cond != -1 && np->cond <= i) || np->cond >= prog->nnode ||
+	   (np->body != -1 && np->body <= i) || np->body >= prog->nnode ||
+	   (np->elsep != -1 && np->elsep <= i) || np->elsep >= prog->nnode ||
+	   np->cmdline < 0 || np->cmdline >= prog->nstr ||
+	   np->in < -1 || np->in >= prog->nword ||
+	   (np->fan != -1 && np->fan <= i) || np->fan >= prog->nnode){
+	    return 0;
+	}
+    }
+    for(i = 0; i < prog->nword; i++){
+	if(prog->word[i].str < 0 || prog->word[i].str >= prog->nstr){
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/***************************************************
+ * Fan-out routines, for cmd |> {c1, c2, ...}.
+ *
+ * Every consumer reads its own pipe. Consumer i (but the last) is fed
+ * by a helper, a forked copy of the shell that tees the stream into
+ * consumer i's pipe and then splices the same bytes on into the pipe
+ * of helper i+1, or of the last consumer. tee(2) and splice(2) only
+ * move page references between pipes, so no byte is ever copied to
+ * user space, and a slow consumer holds the stream back for all. The
+ * producer, the consumers and the helpers share the job's process
+ * group and are reaped as one job.
+ ***************************************************/
+
+/*
+ * fanout - Start the consumers in fan, and their helpers, for job,
+ *    whose producer writes to the pipe read by in. The consumers'
+ *    output goes to outfd unless it is -1. Called with signals blocked.
+ *    Returns 0, or -1 with a message if a pipe or a fork failed; the
+ *    job's process group has been killed then.
+ */
+int fanout(struct job_t *job, int in, char ***fan, int outfd)
+{
+    int cons[2], next[2], i, ok = 1;
+    pid_t pid;
+
+    job->members[0] = job->pid;
+    job->nmembers = job->alive = 1;
+    for (i = 0; fan[i] != NULL; i++) {
+	//the last consumer reads what is left of the stream
+	if (fan[i + 1] == NULL) {
+	    if ((pid = fanchild(job)) == 0) {
+		execcmd(fan[i], in, outfd);
+	    }
+	    ok = pid > 0;
+	    break;
+	}
+	if (pipe2(cons, O_CLOEXEC) < 0) {
+	    printf("pipe: %s\n", strerror(errno));
+	    ok = 0;
+	    break;
+	}
+	if (pipe2(next, O_CLOEXEC) < 0) {
+	    printf("pipe: %s\n", strerror(errno));
+	    close(cons[0]);
+	    close(cons[1]);
+	    ok = 0;
+	    break;
+	}
+	if ((pid = fanchild(job)) == 0) {
+	    execcmd(fan[i], cons[0], outfd);
+	}
+	if (pid > 0 && (pid = fanchild(job)) == 0) {
+	    dup2(in, 0);
+	    dup2(cons[1], 1);
+	    dup2(next[1], 3);
+	    close_range(4, ~0U, 0);
+	    fanhelper();
+	}
+	close(cons[0]);
+	close(cons[1]);
+	close(next[1]);
+	close(in);
+	in = next[0];
+	if (pid < 0) {
+	    ok = 0;
+	    break;
+	}
+    }
+    close(in);
+
+    //none of the job may outlive a half-built fan-out
+    if (!ok) {
+	kill(-job->pid, SIGKILL);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * fanchild - Fork a process into job's process group. The child
+ *    gets default signal handling and returns 0; the shell counts it
+ *    as a member of the job and returns its PID, or -1 with a message
+ *    if the fork failed.
+ */
+pid_t fanchild(struct job_t *job)
+{
+    sigset_t none;
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+	printf("fork: %s\n", strerror(errno));
+	return -1;
+    }
+    if (pid == 0) {
+	setpgid(0, job->pid);
+	Signal(SIGINT, SIG_DFL);
+	Signal(SIGTSTP, SIG_DFL);
+	Signal(SIGCHLD, SIG_DFL);
+	Signal(SIGQUIT, SIG_DFL);
+	Signal(SIGUSR1, SIG_DFL);
+	Signal(SIGALRM, SIG_DFL);
+	Signal(SIGTTOU, SIG_DFL);
+	Signal(SIGTTIN, SIG_DFL);
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	return 0;
+    }
+    setpgid(pid, job->pid);
+    job->members[job->nmembers++] = pid;
+    job->alive++;
+    return pid;
+}
+
+/*
+ * fanhelper - Feed one consumer: tee stdin into stdout, the consumer's
+ *    pipe, then splice what was teed on to fd 3. If the consumer goes
+ *    away the rest just passes through; if fd 3's reader does, the
+ *    consumer still gets everything. Exits at the end of the stream.
+ */
+void fanhelper(void)
+{
+    int teeing = 1, dropping = 0, fd;
+    ssize_t n, k;
+
+    Signal(SIGPIPE, SIG_IGN);
+    while (teeing || !dropping) {
+	if (teeing) {
+	    n = tee(0, 1, FANCHUNK, 0);
+	    if (n < 0 && errno == EPIPE) {
+		teeing = 0;
+		continue;
+	    }
+	} else {
+	    n = splice(0, NULL, 3, NULL, FANCHUNK, SPLICE_F_MOVE);
+	}
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n <= 0) {
+	    exit(n < 0);
+	}
+	if (!teeing) {
+	    continue;
+	}
+
+	//pass exactly the teed bytes on, so the next tee starts after them
+	while (n > 0) {
+	    if ((k = splice(0, NULL, 3, NULL, n, SPLICE_F_MOVE)) < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		//nobody reads fd 3 any more: drop the bytes instead
+		if (dropping || (fd = open("/dev/null", O_WRONLY)) < 0) {
+		    exit(1);
+		}
+		dup2(fd, 3);
+		close(fd);
+		dropping = 1;
+		continue;
+	    }
+	    n -= k;
+	}
+    }
+    exit(0);
+}
+
 /***********************
  * Other helper routines
  ***********************/
 
+/*
+ * execcmd - Exec argv in a child the shell just forked, with stdin from
+ *    infd and stdout and stderr going to outfd, unless they are -1.
+ *    Never returns.
+ */
+void execcmd(char **argv, int infd, int outfd)
+{
+    //the shell ignores these while it juggles the terminal
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+
+    //read a here-document
+    if(infd != -1){
+	dup2(infd, 0);
+    }
+
+    //send stdout and stderr into the capture pipe
+    if(outfd != -1){
+	fcntl(outfd, F_SETFL, 0);
+	dup2(outfd, 1);
+	dup2(outfd, 2);
+    }
+
+    traceev(EV_EXEC, getpid(), 0, 0);
+    execvp(argv[0], argv);
+    traceev(EV_EXECFAIL, getpid(), 0, errno);
+    //If the command is not found we print error message to the user
+    printf("%s: Command not found\n", argv[0]);
+    exit(127);
+}
+
 /*
  * usage - print a help message
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpoC] [-m statusfile] [-c cmdline | script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run the commands in cmdline and exit\n");
+    printf("   -m   publish the job list in statusfile for tshmon\n");
+    printf("   -o   capture the output of background jobs (see logs)\n");
+    printf("   -C   don't use the script cache\n");
     exit(1);
 }
 
+/*
+ * nowns - Wall clock time in nanoseconds since the epoch
+ */
+long long nowns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * traceev - Log one job lifecycle event in the trace ring. Cheap
+ *    enough to be always on, and safe to call from the handlers and
+ *    from forked children.
+ */
+void traceev(int type, pid_t pid, int jid, int arg)
+{
+    struct tshtrace_ev *ev;
+    struct timespec ts;
+    unsigned long long n;
+
+    if (evring == NULL) {
+	return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    n = __atomic_fetch_add(&evring->head, 1, __ATOMIC_RELAXED);
+    ev = &evring->ev[n & (TSHTRACE_NEVENTS - 1)];
+    ev->time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    ev->type = type;
+    ev->pid = pid;
+    ev->jid = jid;
+    ev->arg = arg;
+}
+
+/*
+ * dumptrace - Write the events in the trace ring to path, oldest
+ *    first (see tshfmt.h). Return 0 on success, -1 with errno set.
+ */
+int dumptrace(char *path)
+{
+    struct tshtrace_hdr hdr;
+    struct timespec rt, mt;
+    unsigned long long head, first;
+    size_t n1, n2;
+    int fd;
+
+    if (evring == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    /* never through a symlink someone planted in a shared directory */
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644)) < 0) {
+	return -1;
+    }
+
+    head = __atomic_load_n(&evring->head, __ATOMIC_ACQUIRE);
+    first = head > TSHTRACE_NEVENTS ? head - TSHTRACE_NEVENTS : 0;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TSHTRACE_MAGIC;
+    hdr.version = TSHTRACE_VERSION;
+    hdr.shellpid = getpid();
+    hdr.count = head - first;
+    hdr.total = head;
+    hdr.realtime = (rt.tv_sec - mt.tv_sec) * 1000000000LL
+	+ (rt.tv_nsec - mt.tv_nsec);
+
+    /* The oldest events sit from first's slot to the end of the ring,
+     * the newer ones wrap around to its start */
+    n1 = TSHTRACE_NEVENTS - (first & (TSHTRACE_NEVENTS - 1));
+    if (n1 > hdr.count) {
+	n1 = hdr.count;
+    }
+    n2 = hdr.count - n1;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	write(fd, &evring->ev[first & (TSHTRACE_NEVENTS - 1)],
+	      n1 * sizeof(struct tshtrace_ev)) < 0 ||
+	write(fd, &evring->ev[0], n2 * sizeof(struct tshtrace_ev)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return close(fd);
+}
+
 /*
  * unix_error - unix-style error routine
  */
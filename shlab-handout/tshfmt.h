@@ -0,0 +1,78 @@
+/*
+ * tshfmt.h - Binary formats that tsh shares with outside tools
+ *
+ * The job status page: tsh -m <file> keeps a copy of its job list in
+ * <file>, mapped shared, so that monitors (see tshmon.c) can read it
+ * without talking to the shell. The page is guarded by a sequence
+ * lock: tsh makes seq odd before it changes anything and even again
+ * when it is done, so a reader that sees the same even seq before and
+ * after its copy has a consistent snapshot.
+ *
+ * The event trace: tsh logs job lifecycle events into a fixed-size
+ * ring and writes it out on SIGUSR1 or with the trace builtin. A dump
+ * is a tshtrace_hdr followed by count events, oldest first. tshtrace.c
+ * turns dumps into Chrome trace / Perfetto JSON.
+ */
+#ifndef TSHFMT_H
+#define TSHFMT_H
+
+#include <stdint.h>
+
+#define TSHSTAT_MAGIC   0x54534831  /* "TSH1" */
+#define TSHSTAT_VERSION 1
+#define TSHSTAT_MAXJOBS 16          /* same as MAXJOBS in tsh.c */
+#define TSHSTAT_CMDLEN  1024        /* same as MAXLINE in tsh.c */
+
+struct tshstat_job {             /* one slot of the job list */
+    int32_t pid;                 /* job PID, 0 if the slot is free */
+    int32_t jid;                 /* job ID */
+    int32_t state;               /* 1 FG, 2 BG, 3 ST, 4 RS */
+    int32_t pad;
+    int64_t start;               /* start time, ns since the epoch */
+    int64_t cpu;                 /* CPU time (user+sys) in microseconds,
+                                    as of the last change to the page */
+    char cmdline[TSHSTAT_CMDLEN];
+};
+
+struct tshstat {                 /* the whole status page */
+    uint32_t magic;              /* TSHSTAT_MAGIC */
+    uint32_t version;            /* TSHSTAT_VERSION */
+    uint32_t seq;                /* sequence lock, odd while writing */
+    int32_t shellpid;            /* pid of the publishing shell */
+    int64_t updated;             /* time of the last change, ns */
+    struct tshstat_job job[TSHSTAT_MAXJOBS];
+};
+
+#define TSHTRACE_MAGIC   0x54534845  /* "TSHE" */
+#define TSHTRACE_VERSION 1
+#define TSHTRACE_NEVENTS 4096        /* ring size, a power of 2 */
+
+/* Event types */
+#define EV_FORK     1   /* forked pid */
+#define EV_ADDJOB   2   /* pid became job jid, arg is its state */
+#define EV_EXEC     3   /* pid is about to exec */
+#define EV_EXECFAIL 4   /* exec failed in pid, arg is errno */
+#define EV_SIGNAL   5   /* shell forwarded signal arg to pid's group */
+#define EV_STOP     6   /* pid stopped by signal arg */
+#define EV_CONT     7   /* pid continued, arg is its new state */
+#define EV_REAP     8   /* pid reaped, arg is its wait status */
+
+struct tshtrace_ev {             /* one event */
+    int64_t time;                /* CLOCK_MONOTONIC, ns */
+    int32_t type;                /* EV_* */
+    int32_t pid;
+    int32_t jid;                 /* 0 if not known */
+    int32_t arg;
+};
+
+struct tshtrace_hdr {            /* start of a dump file */
+    uint32_t magic;              /* TSHTRACE_MAGIC */
+    uint32_t version;            /* TSHTRACE_VERSION */
+    int32_t shellpid;
+    uint32_t count;              /* events that follow */
+    uint64_t total;              /* events logged, including overwritten */
+    int64_t realtime;            /* CLOCK_REALTIME minus CLOCK_MONOTONIC,
+                                    ns, for mapping to wall clock */
+};
+
+#endif /* TSHFMT_H */
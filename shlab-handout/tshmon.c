@@ -0,0 +1,133 @@
+/* 
+ * tshmon.c - Print the job lists that tsh shells publish with -m
+ * 
+ * usage: tshmon [-j] <statusfile>...
+ * Maps each status page read-only and prints a consistent snapshot of
+ * its job list, in the format of the jobs builtin or, with -j, as JSON.
+ * No signals or system calls are sent to the shells themselves. The
+ * page only changes when a job does, so the CPU time of a running job
+ * is read from the clock of its process instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tshfmt.h"
+
+static const char *statename[] = { "Undefined", "Foreground", "Running", "Stopped",
+				   "Respawning" };
+
+/* snapshot - Copy the page into *snap under the sequence lock */
+static void snapshot(const struct tshstat *page, struct tshstat *snap)
+{
+    uint32_t seq;
+
+    do {
+	while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+	    sched_yield();
+	memcpy(snap, page, sizeof(*snap));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* jobcpu - CPU time of j in us, sampled now if it is running */
+static long long jobcpu(const struct tshstat_job *j)
+{
+    struct timespec ts;
+    clockid_t clk;
+
+    if ((j->state != 1 && j->state != 2) ||
+	clock_getcpuclockid(j->pid, &clk) != 0 ||
+	clock_gettime(clk, &ts) != 0)
+	return j->cpu;
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* printjson - Print a string as a JSON string literal, minus the '\n' */
+static void printjson(const char *s)
+{
+    putchar('"');
+    for (; *s && *s != '\n'; s++) {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if ((unsigned char)*s < ' ')
+	    printf("\\u%04x", *s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char **argv) 
+{
+    struct tshstat *page, snap;
+    const struct tshstat_job *j;
+    struct stat st;
+    int i, k, fd, json = 0, first = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+	json = 1;
+	argv++, argc--;
+    }
+    if (argc < 2) {
+	fprintf(stderr, "Usage: %s [-j] <statusfile>...\n", argv[0]);
+	exit(1);
+    }
+
+    if (json)
+	printf("[");
+    for (i = 1; i < argc; i++) {
+	if ((fd = open(argv[i], O_RDONLY)) < 0) {
+	    perror(argv[i]);
+	    continue;
+	}
+	/* mapping past the end of a short file would raise SIGBUS */
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*page)) {
+	    fprintf(stderr, "%s: not a tsh status page\n", argv[i]);
+	    close(fd);
+	    continue;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+	    perror(argv[i]);
+	    continue;
+	}
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != TSHSTAT_MAGIC ||
+	    page->version != TSHSTAT_VERSION) {
+	    fprintf(stderr, "%s: not a tsh status page\n", argv[i]);
+	    munmap(page, sizeof(*page));
+	    continue;
+	}
+	snapshot(page, &snap);
+	munmap(page, sizeof(*page));
+
+	for (k = 0; k < TSHSTAT_MAXJOBS; k++) {
+	    j = &snap.job[k];
+	    if (j->pid == 0 || j->state < 1 || j->state > 4)
+		continue;
+	    if (json) {
+		printf("%s\n  {\"shell\": %d, \"jid\": %d, \"pid\": %d, "
+		       "\"state\": \"%s\", \"start_ns\": %lld, \"cpu_us\": %lld, "
+		       "\"cmdline\": ", first ? "" : ",", snap.shellpid, j->jid,
+		       j->pid, statename[j->state], (long long)j->start,
+		       jobcpu(j));
+		printjson(j->cmdline);
+		printf("}");
+	    }
+	    else {
+		printf("%d: [%d] (%d) %s %s", snap.shellpid, j->jid, j->pid,
+		       statename[j->state], j->cmdline);
+	    }
+	    first = 0;
+	}
+    }
+    if (json)
+	printf("%s]\n", first ? "" : "\n");
+    exit(0);
+}
@@ -0,0 +1,164 @@
+/* 
+ * tshtrace.c - Convert a tsh event trace dump to Chrome trace JSON
+ * 
+ * usage: tshtrace <dumpfile> [<jsonfile>]
+ * Reads a dump written by tsh on SIGUSR1 or by its trace builtin and
+ * writes Chrome trace / Perfetto JSON, one track per job, with a slice
+ * for each stretch it spent in the foreground, background or stopped,
+ * and an instant event for every logged event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tshfmt.h"
+
+#define MAXTRACKS 1024  /* jobs we can follow at once */
+
+struct track {           /* an open slice on a job's track */
+    int pid;             /* 0 if the slot is free */
+    const char *name;    /* what the job is doing */
+    long long since;     /* when it started doing it, us */
+};
+
+static const char *evname[] = { "?", "fork", "addjob", "exec", "exec failed",
+				"signal", "stop", "continue", "reap" };
+static struct track tracks[MAXTRACKS];
+static FILE *out;
+static int shellpid, first = 1;
+
+/* emit - Start a new element of the traceEvents array */
+static void emit(void)
+{
+    fprintf(out, "%s\n  ", first ? "" : ",");
+    first = 0;
+}
+
+/* findtrack - Find the track of pid, allocating one if asked to */
+static struct track *findtrack(int pid, int alloc)
+{
+    int i;
+
+    for (i = 0; i < MAXTRACKS; i++)
+	if (tracks[i].pid == pid)
+	    return &tracks[i];
+    if (alloc)
+	for (i = 0; i < MAXTRACKS; i++)
+	    if (tracks[i].pid == 0) {
+		tracks[i].pid = pid;
+		tracks[i].name = NULL;
+		return &tracks[i];
+	    }
+    return NULL;
+}
+
+/* endslice - Close the open slice of pid's track at time now */
+static void endslice(int pid, long long now)
+{
+    struct track *t = findtrack(pid, 0);
+
+    if (t == NULL || t->name == NULL)
+	return;
+    emit();
+    fprintf(out, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, "
+	    "\"pid\": %d, \"tid\": %d}", t->name, t->since, now - t->since,
+	    shellpid, pid);
+    t->name = NULL;
+}
+
+/* beginslice - Open a new slice called name on pid's track */
+static void beginslice(int pid, const char *name, long long now)
+{
+    struct track *t;
+
+    endslice(pid, now);
+    if ((t = findtrack(pid, 1)) != NULL) {
+	t->name = name;
+	t->since = now;
+    }
+}
+
+/* statename - Slice name for a job in tsh state st */
+static const char *statename(int st)
+{
+    return st == 1 ? "foreground" : st == 2 ? "background" : "stopped";
+}
+
+int main(int argc, char **argv) 
+{
+    struct tshtrace_hdr hdr;
+    struct tshtrace_ev ev;
+    FILE *in;
+    long long ts = 0;
+    unsigned i;
+    int k;
+
+    if (argc != 2 && argc != 3) {
+	fprintf(stderr, "Usage: %s <dumpfile> [<jsonfile>]\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "rb")) == NULL) {
+	perror(argv[1]);
+	exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != TSHTRACE_MAGIC ||
+	hdr.version != TSHTRACE_VERSION) {
+	fprintf(stderr, "%s: not a tsh trace dump\n", argv[1]);
+	exit(1);
+    }
+    out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+	perror(argv[2]);
+	exit(1);
+    }
+    shellpid = hdr.shellpid;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    emit();
+    fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+	    "\"args\": {\"name\": \"tsh %d\"}}", shellpid, shellpid);
+    if (hdr.total > hdr.count) {
+	emit();
+	fprintf(out, "{\"name\": \"%llu older events lost\", \"ph\": \"i\", "
+		"\"s\": \"p\", \"ts\": 0, \"pid\": %d, \"tid\": %d}",
+		(unsigned long long)(hdr.total - hdr.count), shellpid, shellpid);
+    }
+
+    for (i = 0; i < hdr.count && fread(&ev, sizeof(ev), 1, in) == 1; i++) {
+	if (ev.type < EV_FORK || ev.type > EV_REAP)
+	    continue;
+	ts = ev.time / 1000;
+
+	emit();
+	fprintf(out, "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %lld, "
+		"\"pid\": %d, \"tid\": %d, \"args\": {\"jid\": %d, \"arg\": %d}}",
+		evname[ev.type], ts, shellpid, ev.pid, ev.jid, ev.arg);
+
+	switch (ev.type) {
+	case EV_ADDJOB:
+	    emit();
+	    fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+		    "\"tid\": %d, \"args\": {\"name\": \"job [%d] (%d)\"}}",
+		    shellpid, ev.pid, ev.jid, ev.pid);
+	    beginslice(ev.pid, statename(ev.arg), ts);
+	    break;
+	case EV_STOP:
+	    beginslice(ev.pid, statename(3), ts);
+	    break;
+	case EV_CONT:
+	    beginslice(ev.pid, statename(ev.arg), ts);
+	    break;
+	case EV_REAP:
+	    endslice(ev.pid, ts);
+	    if (findtrack(ev.pid, 0) != NULL)
+		findtrack(ev.pid, 0)->pid = 0;
+	    break;
+	}
+    }
+
+    /* Jobs still alive at dump time run to the last event */
+    for (k = 0; k < MAXTRACKS; k++)
+	if (tracks[k].pid != 0)
+	    endslice(tracks[k].pid, ts);
+    fprintf(out, "\n]}\n");
+    exit(0);
+}